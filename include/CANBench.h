@@ -0,0 +1,232 @@
+#pragma once
+
+/*
+	Бенчмарк обработки CAN команд, собирается только в окружении Benchmark (-DCAN_BENCHMARK).
+	Кадры подаются напрямую в CANLib::can_manager, в шину ничего не отправляется.
+	Команды доходят до реальных обработчиков, но выводы портов и мостов переводятся во входы,
+	поэтому нагрузки не включаются. Всё равно лучше запускать на плате без подключённых нагрузок.
+	Только на плате: сборки для хоста у проекта нет.
+*/
+
+#include <CANLibrary.h>
+
+namespace CANBench
+{
+	static constexpr uint32_t CFG_ScenarioTime = 3000;		// Длительность одного сценария, мс.
+	static constexpr uint8_t CFG_ForeignPerTick = 4;		// Кол-во чужих кадров за тик в фоновом сценарии.
+	static constexpr can_object_id_t CFG_ForeignIdBase = 0x0100;	// Начало диапазона чужих ID.
+	static constexpr uint8_t CFG_BurstMax = CANLib::CFG_CANFrameBufferSize + 4;	// Максимальная пачка при поиске ёмкости буфера.
+	static constexpr uint8_t CFG_StickStep = 4;				// Шаг положения джойстика между кадрами set.
+
+	// Объекты управления, по которым идут переключения.
+	static constexpr can_object_id_t CFG_ControlIds[] = { 0x0184, 0x0185, 0x0186, 0x0187, 0x0188, 0x0189, 0x018A, 0x018B };
+
+	enum scenario_t : uint8_t { SCENARIO_TRUNK_FLOOD, SCENARIO_MIXED_TOGGLE, SCENARIO_FOREIGN, SCENARIO_BUFFER, SCENARIO_DONE };
+
+	struct result_t
+	{
+		uint32_t injected;			// Кадров подано в CANManager.
+		uint32_t replies;			// Кадров отправлено CANManager'ом.
+		uint32_t frames;			// Кадров, обработанных за вызовы Process().
+		uint32_t cycles;			// Суммарное время Process(), такты.
+		uint32_t cycles_max;		// Худший вызов Process(), такты.
+	};
+
+	static constexpr const char *scenario_names[] = { "trunk set flood", "mixed toggles", "foreign ids", "buffer" };
+
+	scenario_t scenario = SCENARIO_TRUNK_FLOOD;
+	result_t result = {};
+	uint32_t scenario_start = 0;
+	uint32_t last_tick = 0;
+	uint32_t counter = 0;
+
+	uint8_t high_water = 0;			// Наибольшая пачка, обработанная без потерь.
+	uint8_t burst_drops = 0;		// Потери на пачке CFG_BurstMax.
+
+	volatile uint32_t tx_frames = 0;
+
+
+	// Вызывается из HAL_CAN_Send() вместо отправки в шину.
+	inline void OnSend(can_object_id_t id)
+	{
+		++tx_frames;
+
+		return;
+	}
+
+	void Inject(can_object_id_t id, uint8_t function, int8_t value)
+	{
+		uint8_t data[2] = { function, (uint8_t)value };
+
+		CANLib::can_manager.IncomingCANFrame(id, data, (function == CAN_FUNC_SET_IN) ? 2 : 1);
+		++result.injected;
+
+		return;
+	}
+
+	// Положение джойстика в кадрах set: треугольник -100..100 с шагом CFG_StickStep. Соседние значения всегда разные,
+	// поэтому замеряется ход, реверс и смена скорости актуатора, а не пустой возврат LogicSet().
+	int8_t StickValue(uint32_t tick)
+	{
+		uint32_t phase = (tick * CFG_StickStep) % 400;
+
+		return (phase < 200) ? (int8_t)((int32_t)phase - 100) : (int8_t)(300 - (int32_t)phase);
+	}
+
+	void TimedProcess(uint32_t current_time, uint32_t frames)
+	{
+		uint32_t start = DWT->CYCCNT;
+		CANLib::can_manager.Process(current_time);
+		CANLib::ApplyActuatorCommands();
+		uint32_t cycles = DWT->CYCCNT - start;
+
+		result.cycles += cycles;
+		result.frames += frames;
+		if(cycles > result.cycles_max) result.cycles_max = cycles;
+
+		return;
+	}
+
+	// elapsed - измеренная длительность сценария, мс.
+	void Report(uint32_t elapsed)
+	{
+		uint32_t handled = (elapsed > 0) ? ((uint64_t)result.frames * 1000) / elapsed : 0;
+		uint32_t per_frame = (result.frames > 0) ? result.cycles / result.frames : 0;
+
+		Logger.PrintTopic("BENCH").Printf("%s: %lu fps handled, %lu cycles/frame, %lu cycles max, replies: %lu, coalesced total: %lu",
+			scenario_names[scenario], handled, per_frame, result.cycles_max, result.replies, CANLib::commands_coalesced).PrintNewLine();
+
+		return;
+	}
+
+	// Ищет наибольшую пачку запросов, на которую приходят все ответы.
+	void RunBuffer(uint32_t current_time)
+	{
+		for(uint8_t burst = 1; burst <= CFG_BurstMax; ++burst)
+		{
+			uint32_t tx_before = tx_frames;
+			for(uint8_t i = 0; i < burst; ++i)
+			{
+				Inject(CANLib::obj_block_info.GetId(), CAN_FUNC_REQUEST_IN, 0);
+			}
+			TimedProcess(current_time, burst);
+			CANLib::can_manager.Process(current_time);
+
+			uint32_t replies = tx_frames - tx_before;
+			if(replies >= burst)
+			{
+				high_water = burst;
+			}
+			if(burst == CFG_BurstMax)
+			{
+				burst_drops = burst - replies;
+			}
+		}
+
+		Logger.PrintTopic("BENCH").Printf("buffer: %d frames lossless, %d of %d dropped, CFG_CANFrameBufferSize: %d",
+			high_water, burst_drops, CFG_BurstMax, CANLib::CFG_CANFrameBufferSize).PrintNewLine();
+
+		return;
+	}
+
+	// Выводы нагрузок во вход: ODR и таймеры меняются обработчиками как обычно, но выходы не управляются.
+	void ReleasePins()
+	{
+		GPIO_InitTypeDef input = { GPIO_PIN_0, GPIO_MODE_INPUT, GPIO_PULLDOWN, GPIO_SPEED_FREQ_LOW };
+		for(const Outputs::port_t &port : Outputs::CFG_Ports)
+		{
+			input.Pin = port.pin;
+			HAL_GPIO_Init(port.port, &input);
+		}
+		for(const TrunkHood::actuator_config_t &config : TrunkHood::CFG_Actuators)
+		{
+			for(const DRV8874::pin_t &pin : { config.in1, config.in2, config.en })
+			{
+				input.Pin = pin.Pin;
+				HAL_GPIO_Init(pin.Port, &input);
+			}
+		}
+
+		return;
+	}
+
+	// Вызывается после Setup() всех модулей, чтобы их инициализация выводов уже прошла.
+	inline void Setup()
+	{
+		ReleasePins();
+		Logger.PrintTopic("BENCH").Printf("CAN benchmark, %d objects, buffer %d", CANLib::CFG_CANObjectsCount, CANLib::CFG_CANFrameBufferSize).PrintNewLine();
+		scenario_start = HAL_GetTick();
+
+		return;
+	}
+
+	// Вызывается перед CANLib::Loop(), чтобы поданные кадры обрабатывались замеряемым Process().
+	inline void Loop(uint32_t &current_time)
+	{
+		if(scenario == SCENARIO_DONE) return;
+
+		if(scenario == SCENARIO_BUFFER)
+		{
+			RunBuffer(current_time);
+			scenario = SCENARIO_DONE;
+
+			return;
+		}
+
+		if(current_time - scenario_start >= CFG_ScenarioTime)
+		{
+			Report(current_time - scenario_start);
+
+			result = {};
+			counter = 0;
+			scenario = (scenario_t)(scenario + 1);
+			scenario_start = current_time;
+
+			return;
+		}
+
+		// Тик 1 мс.
+		if(current_time == last_tick) return;
+		last_tick = current_time;
+
+		uint32_t tx_before = tx_frames;
+		uint32_t injected = result.injected;
+		switch(scenario)
+		{
+			case SCENARIO_TRUNK_FLOOD:
+			{
+				Inject(CANLib::obj_trunk_control.GetId(), CAN_FUNC_SET_IN, StickValue(counter));
+
+				break;
+			}
+			case SCENARIO_MIXED_TOGGLE:
+			{
+				Inject(CFG_ControlIds[counter % (sizeof(CFG_ControlIds) / sizeof(CFG_ControlIds[0]))], CAN_FUNC_TOGGLE_IN, 0);
+
+				break;
+			}
+			case SCENARIO_FOREIGN:
+			{
+				for(uint8_t i = 0; i < CFG_ForeignPerTick; ++i)
+				{
+					Inject(CFG_ForeignIdBase + ((counter * CFG_ForeignPerTick + i) & 0x7F), CAN_FUNC_SET_IN, 0);
+				}
+				Inject(CANLib::obj_trunk_control.GetId(), CAN_FUNC_SET_IN, StickValue(counter));
+
+				break;
+			}
+			default:
+			{
+				break;
+			}
+		}
+		++counter;
+
+		TimedProcess(current_time, result.injected - injected);
+		result.replies += tx_frames - tx_before;
+
+		current_time = HAL_GetTick();
+
+		return;
+	}
+}
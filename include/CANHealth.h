@@ -0,0 +1,255 @@
+#pragma once
+
+#include <CANLibrary.h>
+#include <CANStats.h>
+#include <LoggerLibrary.h>
+
+extern CAN_HandleTypeDef hcan;
+
+namespace CANHealth
+{
+	static constexpr uint16_t CFG_SampleInterval = 250;		// Период опроса регистра ESR, мс.
+	static constexpr uint8_t CFG_BusOffLimit = 3;			// Кол-во bus-off за окно, после которого узел уходит в паузу.
+	static constexpr uint32_t CFG_BusOffWindow = 10000;		// Окно подсчёта bus-off, мс.
+	static constexpr uint32_t CFG_BackoffMin = 500;			// Начальная пауза перед повторным подключением к шине, мс.
+	static constexpr uint32_t CFG_BackoffMax = 16000;		// Максимальная пауза перед повторным подключением к шине, мс.
+	static constexpr uint32_t CFG_StableTime = 60000;		// Время без bus-off, после которого пауза сбрасывается до начальной, мс.
+
+	// Байты obj_block_health.
+	enum health_byte_t : uint8_t
+	{
+		HEALTH_TEC = 0,				// Счётчик ошибок передачи.
+		HEALTH_REC = 1,				// Счётчик ошибок приёма.
+		HEALTH_STATUS = 2,			// Флаги EWGF/EPVF/BOFF (биты 0..2), последний LEC (биты 4..6), пауза (бит 7).
+		HEALTH_BUSOFF_COUNT = 3,	// Кол-во переходов в bus-off.
+		HEALTH_PASSIVE_COUNT = 4,	// Кол-во переходов в error-passive.
+		HEALTH_ERROR_COUNT = 5,		// Кол-во прерываний по ошибкам шины.
+		HEALTH_BUS_LOAD = 6,		// Загрузка шины, %.
+		HEALTH_COUNT
+	};
+
+	// Байты статистики ошибок: кол-во ошибок по LEC 1..6 и переполнений RX FIFO, до 255.
+	enum errors_byte_t : uint8_t
+	{
+		ERRORS_STUFF = 0,
+		ERRORS_FORM = 1,
+		ERRORS_ACK = 2,
+		ERRORS_BIT_RECESSIVE = 3,
+		ERRORS_BIT_DOMINANT = 4,
+		ERRORS_CRC = 5,
+		ERRORS_RX_OVERRUN = 6,
+		ERRORS_COUNT
+	};
+
+	// Публикация здоровья в CAN, event - переход в error-passive или bus-off.
+	using publish_event_t = void (*)(const uint8_t (&values)[HEALTH_COUNT], bool event);
+
+	enum recovery_t : uint8_t { RECOVERY_NONE, RECOVERY_SUSPENDED };
+
+	struct health_t
+	{
+		uint8_t tec;					// Последнее значение TEC.
+		uint8_t rec;					// Последнее значение REC.
+		uint8_t esr_flags;				// Последние флаги EWGF/EPVF/BOFF.
+		uint8_t last_lec;				// Последний код ошибки (LEC).
+		uint8_t busoff_count;			// Кол-во переходов в bus-off.
+		uint8_t passive_count;			// Кол-во переходов в error-passive.
+		uint8_t error_count;			// Кол-во прерываний по ошибкам.
+		uint8_t lec_histogram[8];		// Гистограмма кодов ошибок, индекс = LEC.
+		uint8_t rx_overrun_count;		// Кол-во переполнений RX FIFO.
+	};
+
+	health_t health = {};
+	publish_event_t publish_event = nullptr;
+
+	volatile uint32_t irq_errors = 0;		// Ошибки HAL, накопленные в прерывании.
+	volatile uint8_t irq_count = 0;			// Кол-во прерываний по ошибкам с последнего опроса.
+
+	recovery_t recovery = RECOVERY_NONE;
+	uint32_t recovery_time = 0;				// Время окончания паузы.
+	uint32_t backoff = CFG_BackoffMin;		// Текущая длительность паузы.
+	uint32_t window_start = 0;				// Начало окна подсчёта bus-off.
+	uint8_t window_busoff = 0;				// Кол-во bus-off в текущем окне.
+	uint32_t last_busoff_time = 0;
+
+
+	// Вызывается из HAL_CAN_ErrorCallback().
+	inline void ErrorIRQ(CAN_HandleTypeDef *can)
+	{
+		irq_errors |= HAL_CAN_GetError(can);
+		if(irq_count < 0xFF) ++irq_count;
+
+		HAL_CAN_ResetError(can);
+
+		return;
+	}
+
+	inline void SetPublishEvent(publish_event_t event)
+	{
+		publish_event = event;
+
+		return;
+	}
+
+	// Статистика ошибок в порядке errors_byte_t.
+	void GetErrors(uint8_t (&values)[ERRORS_COUNT])
+	{
+		for(uint8_t lec = 1; lec <= ERRORS_CRC + 1; ++lec)
+		{
+			values[lec - 1] = health.lec_histogram[lec];
+		}
+		values[ERRORS_RX_OVERRUN] = health.rx_overrun_count;
+
+		return;
+	}
+
+	inline bool IsSuspended()
+	{
+		return recovery == RECOVERY_SUSPENDED;
+	}
+
+	void CountErrors(uint32_t errors)
+	{
+		// Порядок соответствует значениям LEC: 1 - Stuff, 2 - Form, 3 - ACK, 4 - Bit recessive, 5 - Bit dominant, 6 - CRC.
+		static constexpr uint32_t lec_errors[] = { HAL_CAN_ERROR_STF, HAL_CAN_ERROR_FOR, HAL_CAN_ERROR_ACK, HAL_CAN_ERROR_BR, HAL_CAN_ERROR_BD, HAL_CAN_ERROR_CRC };
+
+		for(uint8_t i = 0; i < sizeof(lec_errors) / sizeof(lec_errors[0]); ++i)
+		{
+			if( (errors & lec_errors[i]) && health.lec_histogram[i + 1] < 0xFF )
+			{
+				++health.lec_histogram[i + 1];
+			}
+		}
+
+		if( (errors & HAL_CAN_ERROR_RX_FOV0) && health.rx_overrun_count < 0xFF )
+		{
+			++health.rx_overrun_count;
+		}
+
+		return;
+	}
+
+	void Suspend(uint32_t current_time)
+	{
+		HAL_CAN_AbortTxRequest(&hcan, CAN_TX_MAILBOX0 | CAN_TX_MAILBOX1 | CAN_TX_MAILBOX2);
+		HAL_CAN_Stop(&hcan);
+
+		recovery = RECOVERY_SUSPENDED;
+		recovery_time = current_time + backoff;
+
+		DEBUG_LOG_TOPIC("CAN", "bus-off limit reached, back-off %lu ms\n", backoff);
+
+		backoff = (backoff * 2 > CFG_BackoffMax) ? CFG_BackoffMax : backoff * 2;
+
+		return;
+	}
+
+	void OnBusOff(uint32_t current_time)
+	{
+		if(health.busoff_count < 0xFF) ++health.busoff_count;
+		last_busoff_time = current_time;
+
+		if(current_time - window_start > CFG_BusOffWindow)
+		{
+			window_start = current_time;
+			window_busoff = 0;
+		}
+
+		// Одиночный bus-off восстанавливается аппаратно (AutoBusOff), серия - через паузу.
+		if(++window_busoff >= CFG_BusOffLimit)
+		{
+			window_busoff = 0;
+			Suspend(current_time);
+		}
+
+		return;
+	}
+
+	void Publish(bool event)
+	{
+		uint8_t status = health.esr_flags | (health.last_lec << 4) | ((recovery == RECOVERY_SUSPENDED) ? 0x80 : 0x00);
+		const uint8_t values[HEALTH_COUNT] = 
+		{
+			health.tec, health.rec, status, health.busoff_count, health.passive_count, health.error_count, 
+			(uint8_t)((CANStats::bus_load + 5) / 10)
+		};
+
+		if(publish_event != nullptr)
+		{
+			publish_event(values, event);
+		}
+
+		return;
+	}
+
+	inline void Setup()
+	{
+		Publish(false);
+
+		return;
+	}
+
+	inline void Loop(uint32_t &current_time)
+	{
+		if(recovery == RECOVERY_SUSPENDED && (int32_t)(current_time - recovery_time) >= 0)
+		{
+			recovery = RECOVERY_NONE;
+			HAL_CAN_Start(&hcan);
+
+			DEBUG_LOG_TOPIC("CAN", "back-off done, rejoining bus\n");
+		}
+
+		if(backoff != CFG_BackoffMin && current_time - last_busoff_time > CFG_StableTime)
+		{
+			backoff = CFG_BackoffMin;
+		}
+
+		static uint32_t last_time = 0;
+		if(current_time - last_time > CFG_SampleInterval)
+		{
+			last_time = current_time;
+
+			__disable_irq();
+			uint32_t errors = irq_errors;
+			uint8_t count = irq_count;
+			irq_errors = 0;
+			irq_count = 0;
+			__enable_irq();
+
+			uint32_t esr = hcan.Instance->ESR;
+			uint8_t flags = esr & (CAN_ESR_EWGF | CAN_ESR_EPVF | CAN_ESR_BOFF);
+			uint8_t lec = (esr & CAN_ESR_LEC) >> CAN_ESR_LEC_Pos;
+
+			health.tec = (esr & CAN_ESR_TEC) >> CAN_ESR_TEC_Pos;
+			health.rec = (esr & CAN_ESR_REC) >> CAN_ESR_REC_Pos;
+			if(lec != 0) health.last_lec = lec;
+			health.error_count = (health.error_count + count > 0xFF) ? 0xFF : health.error_count + count;
+
+			CountErrors(errors);
+
+			// Переход в bus-off мог завершиться аппаратно до опроса, поэтому учитываем и флаг из прерывания.
+			bool busoff = (flags & CAN_ESR_BOFF) || (errors & HAL_CAN_ERROR_BOF);
+			bool passive = (flags & CAN_ESR_EPVF) || (errors & HAL_CAN_ERROR_EPV);
+			bool transition = false;
+
+			if(busoff && !(health.esr_flags & CAN_ESR_BOFF))
+			{
+				OnBusOff(current_time);
+				transition = true;
+			}
+			if(passive && !(health.esr_flags & CAN_ESR_EPVF))
+			{
+				if(health.passive_count < 0xFF) ++health.passive_count;
+				transition = true;
+			}
+
+			health.esr_flags = flags;
+
+			Publish(transition);
+		}
+
+		current_time = HAL_GetTick();
+
+		return;
+	}
+}
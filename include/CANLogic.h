@@ -1,5 +1,6 @@
 #pragma once
 
+#include <string.h>
 #include <CANLibrary.h>
 
 void HAL_CAN_Send(can_object_id_t id, uint8_t *data, uint8_t length);
@@ -13,11 +14,20 @@ namespace CANLib
 	//*********************************************************************
 
 	/// @brief Number of CANObjects in CANManager
-	static constexpr uint8_t CFG_CANObjectsCount = 12;
+	static constexpr uint8_t CFG_CANObjectsCount = 20;
 
 	/// @brief The size of CANManager's internal CAN frame buffer
 	static constexpr uint8_t CFG_CANFrameBufferSize = 16;
 
+	/// @brief Period of obj_outputs_current timer frames, ms
+	static constexpr uint32_t CFG_OutputsCurrentPeriod = 1000;
+
+	/// @brief Port currents sampling interval, ms
+	static constexpr uint32_t CFG_OutputsCurrentSample = 100;
+
+	/// @brief Current change of any port sent as an event at once, 50 mA units
+	static constexpr uint8_t CFG_OutputsCurrentDelta = 4;
+
 	enum HardwareErrorCodes : uint8_t
 	{
 		ERROR_CODE_HW_NONE = 0x00,
@@ -25,6 +35,10 @@ namespace CANLib
 		ERROR_CODE_HW_CABIN_LIGHT_ERROR = 0x02,
 		ERROR_CODE_HW_REAR_CAMERA_ERROR = 0x03,
 		ERROR_CODE_HW_HORN_ERROR = 0x04,
+		ERROR_CODE_HW_HOOD_ACTUATOR_ERROR = 0x05,
+		ERROR_CODE_HW_TRUNK_ACTUATOR_ERROR = 0x06,
+		ERROR_CODE_HW_LEFT_DOOR_ERROR = 0x07,
+		ERROR_CODE_HW_RIGHT_DOOR_ERROR = 0x08,
 	};
 
 	//*********************************************************************
@@ -101,8 +115,8 @@ namespace CANLib
 
 	// 0x0189	CabinLightControl
 	// set | toggle | request | event
-	// uint8_t	00 || FF	1 + 1	{ type[0] } or { type[0] data[1] }
-	// Управление светом в салоне.
+	// uint8_t	0 .. 255	1 + 1	{ type[0] } or { type[0] data[1] }
+	// Управление светом в салоне: яркость с плавным изменением, 0 - выключен. Toggle включает последнюю яркость.
 	CANObject<uint8_t, 1> obj_cabinlight_control(0x0189, CAN_TIMER_DISABLED, 300);
 
 
@@ -118,195 +132,565 @@ namespace CANLib
 	// uint8_t	00 || FF	1 + 1	{ type[0] } or { type[0] data[1] }
 	// Управление клаксоном.
 	CANObject<uint8_t, 1> obj_horn_control(0x018B, CAN_TIMER_DISABLED, 300);
+
+
+	// 0x018C	CANLatency
+	// set | request | event
+	// uint16_t	0 .. 65535	1 + 6	{ type[0] p50[1..2] p90[3..4] p99[5..6] } или { type[0] handler[1..2] action[3..4] queued[5..6] }
+	// Задержка от приёма команды управления актуатором до отправки ответа, мкс. set { page[1] } выбирает данные:
+	// 0 - перцентили полной задержки, 1 - средние времена этапов от приёма: вход в обработчик, действие, постановка в почтовый ящик.
+	CANObject<uint16_t, 3> obj_can_latency(0x018C);
+	
+	enum latency_page_t : uint8_t { LATENCY_PERCENTILES, LATENCY_STAGES, LATENCY_PAGE_COUNT };
+	uint8_t latency_page = LATENCY_PERCENTILES;
+
+
+	// 0x018D	ActuatorPosition
+	// set | request | event
+	// uint8_t	0 .. 100	1 + 2	{ type[0] hood[1] trunk[2] }
+	// Положение актуаторов в порядке TrunkHood::CFG_Actuators, %. 0xFF - идёт поиск положения. В set значение 0xFF оставляет актуатор без изменений.
+	CANObject<uint8_t, TrunkHood::CFG_ActuatorsCount> obj_actuator_position(0x018D, CAN_TIMER_DISABLED, 300);
+
+
+	// 0x018E	OutputsCurrent
+	// request | timer:CFG_OutputsCurrentPeriod | event
+	// uint8_t	0 .. 255	1 + 7	{ type[0] port1[1] .. port6[6] state[7] }
+	// Ток портов PowerOut, 50 мА (до 12,75 А). state - битовая маска включённых портов, бит 0 - порт 1.
+	CANObject<uint8_t, Outputs::CFG_PortCount + 1> obj_outputs_current(0x018E, CFG_OutputsCurrentPeriod, 300);
+
+
+	// 0x018F	EnergyStats
+	// set | request | event
+	// uint8_t	0 .. 255	1 + 6	{ type[0] load[1] counter[2] value[3..6] }
+	// Счётчики нагрузки: set { load[1] counter[2] } выбирает нагрузку (PowerBudget::load_id_t) и счётчик
+	// (EnergyStats::counter_id_t: 0 - заряд, мАч; 1 - время во включённом состоянии, с; 2 - кол-во включений).
+	// Ответ - событие со значением uint32_t на момент выбора, request возвращает его же.
+	CANObject<uint8_t, 6> obj_energy_stats(0x018F, CAN_TIMER_DISABLED, 300);
+
+
+	// 0x0190	OutputPattern
+	// set | request | event
+	// uint8_t	0 .. 255	1 + 2	{ type[0] port[1] pattern[2] }
+	// Запуск шаблона Outputs::pattern_id_t на порту 1..6, кроме диммера. pattern 0 останавливает шаблон и выключает порт.
+	// Ответ - событие с принятыми port и pattern, request возвращает последний запуск.
+	CANObject<uint8_t, 2> obj_output_pattern(0x0190, CAN_TIMER_DISABLED, 300);
+
+
+	// 0x0191	ParkingMode
+	// set | request | event
+	// uint8_t	0 .. 1	1 + 1	{ type[0] state[1] }
+	// set 1 выключает порты и переводит блок в STOP после остановки актуаторов, set 0 отменяет запрос.
+	// Блок просыпается от любого кадра на шине, кадр пробуждения теряется: команду после стоянки нужно повторить.
+	CANObject<uint8_t, 1> obj_parking_mode(0x0191, CAN_TIMER_DISABLED, 300);
+
+
+	// 0x0192	CANErrors
+	// request
+	// uint8_t	0 .. 255	1 + 7	{ type[0] stuff[1] form[2] ack[3] bit_recessive[4] bit_dominant[5] crc[6] rx_overrun[7] }
+	// Кол-во ошибок шины по кодам LEC и переполнений RX FIFO с запуска, до 255. См. CANHealth::errors_byte_t.
+	CANObject<uint8_t, CANHealth::ERRORS_COUNT> obj_can_errors(0x0192);
+
+
+	// 0x0193	PowerBudget
+	// request | event
+	// uint16_t	0 .. 65535	1 + 6	{ type[0] queued[1..2] forced[3..4] delay_max[5..6] }
+	// Отложенные пуски нагрузок: кол-во отложенных, выполненных сверх бюджета по PowerBudget::CFG_MaxDelay,
+	// наибольшая задержка пуска, мс. Пуск сверх бюджета отправляется событием.
+	CANObject<uint16_t, 3> obj_power_budget(0x0193);
+	
+	// Привязка актуаторов к CAN объектам управления и кодам ошибок, порядок совпадает с TrunkHood::CFG_Actuators.
+	struct actuator_binding_t
+	{
+		CANObject<int8_t, 1> *control;
+		uint8_t error_code;
+	};
+	
+	static constexpr actuator_binding_t CFG_ActuatorBindings[] = 
+	{
+		{ &obj_hood_control, ERROR_CODE_HW_HOOD_ACTUATOR_ERROR },
+		{ &obj_trunk_control, ERROR_CODE_HW_TRUNK_ACTUATOR_ERROR },
+	};
+	static_assert(sizeof(CFG_ActuatorBindings) / sizeof(CFG_ActuatorBindings[0]) == TrunkHood::CFG_ActuatorsCount, "Every actuator needs a CAN binding");
+	
+	// Команда джойстика, ожидающая применения. Поток set кадров сворачивается до последней команды за вызов Loop().
+	struct actuator_command_t
+	{
+		int8_t position;
+		bool pending;
+	};
+	
+	actuator_command_t actuator_commands[TrunkHood::CFG_ActuatorsCount] = {};
+	uint32_t commands_coalesced = 0;		// Кол-во команд, заменённых более новыми до применения.
 	
 	inline uint8_t on_off_validator(uint8_t value)
 	{
 		return (value > 0) ? 0xFF : 0;
 	}
 	
-	inline void Setup()
+	// Режим порта: вкл/выкл (значение 00 || FF) или диммер (значение - яркость).
+	enum output_mode_t : uint8_t { OUTPUT_SWITCH, OUTPUT_DIMMER };
+	
+	// Привязка портов PowerOut к CAN объектам управления set/toggle. Новый выход - новая строка.
+	struct output_binding_t
+	{
+		CANObject<uint8_t, 1> *control;
+		uint8_t port;
+		uint8_t error_code;
+		output_mode_t mode;
+	};
+	
+	static constexpr output_binding_t CFG_OutputBindings[] = 
 	{
-		obj_trunk_control
-			.RegisterFunctionSet([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+		{ &obj_secelec_control, 1, ERROR_CODE_HW_SECONDARY_ELECTRONICS_ERROR, OUTPUT_SWITCH },
+		{ &obj_cabinlight_control, Outputs::CFG_DimmerPort, ERROR_CODE_HW_CABIN_LIGHT_ERROR, OUTPUT_DIMMER },
+		{ &obj_rearcamera_control, 5, ERROR_CODE_HW_REAR_CAMERA_ERROR, OUTPUT_SWITCH },
+		{ &obj_horn_control, 6, ERROR_CODE_HW_HORN_ERROR, OUTPUT_SWITCH },
+	};
+	
+	static constexpr size_t CFG_OutputBindingsCount = sizeof(CFG_OutputBindings) / sizeof(CFG_OutputBindings[0]);
+	
+	constexpr bool IsUniqueOutputPort(size_t i, size_t j)
+	{
+		return j == CFG_OutputBindingsCount || (CFG_OutputBindings[i].port != CFG_OutputBindings[j].port && IsUniqueOutputPort(i, j + 1));
+	}
+	
+	// Проверка таблицы при сборке: порт существует, диммер только на порту с ШИМ, порт не занят дважды.
+	constexpr bool IsValidOutputBinding(size_t i = 0)
+	{
+		return i == CFG_OutputBindingsCount ||
+			( CFG_OutputBindings[i].port >= 1 && CFG_OutputBindings[i].port <= Outputs::CFG_PortCount &&
+			(CFG_OutputBindings[i].mode != OUTPUT_DIMMER || CFG_OutputBindings[i].port == Outputs::CFG_DimmerPort) &&
+			IsUniqueOutputPort(i, i + 1) && IsValidOutputBinding(i + 1) );
+	}
+	static_assert(IsValidOutputBinding(), "Invalid CFG_OutputBindings row");
+	
+	/// @brief Writes several consecutive fields of a CANObject as one update.
+	/// Only the last field gets the timer/event type, so the object is marked once
+	/// and a timer or event frame never carries a half-updated group of fields.
+	template <typename O, typename T, uint8_t N, typename... Args>
+	inline void SetValues(O &obj, uint8_t index, const T (&values)[N], Args... args)
+	{
+		static_assert(N > 0, "At least one field is required");
+		
+		for(uint8_t i = 0; i < N - 1; ++i)
+		{
+			obj.SetValue(index + i, values[i], CAN_TIMER_TYPE_NONE);
+		}
+		obj.SetValue(index + N - 1, values[N - 1], args...);
+		
+		return;
+	}
+	
+	/// @brief Writes a multi-byte value (little-endian) into consecutive byte fields of a CANObject.
+	template <typename O, typename V, typename... Args>
+	inline void SetBytes(O &obj, uint8_t index, V value, Args... args)
+	{
+		uint8_t data[sizeof(V)];
+		memcpy(data, &value, sizeof(V));
+		
+		return SetValues(obj, index, data, args...);
+	}
+	
+	/// @brief Reports a hardware error through obj_block_error: { code[0] detail[1] }.
+	/// @param code One of HardwareErrorCodes.
+	/// @param detail Source specific reason, e.g. DRV8874::event_t.
+	inline void RaiseError(uint8_t code, uint8_t detail)
+	{
+		const uint8_t values[] = { code, detail };
+		SetValues(obj_block_error, 0, values, CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
+		
+		return;
+	}
+	
+	// Обработка событий драйверов актуаторов. Упор - штатное событие, остальные сообщаются как ошибка.
+	inline void OnActuatorEvent(TrunkHood::actuator_t &actuator, uint8_t error_code, uint8_t event)
+	{
+		TrunkHood::OnDriverEvent(actuator, event);
+		
+		if(event != DRV8874::EVENT_ENDSTOP)
+		{
+			RaiseError(error_code, event);
+		}
+		
+		return;
+	}
+	
+	// Коды ошибок портов PowerOut, индекс - номер порта - 1.
+	static constexpr uint8_t CFG_PortErrorCodes[] = 
+	{
+		ERROR_CODE_HW_SECONDARY_ELECTRONICS_ERROR,
+		ERROR_CODE_HW_LEFT_DOOR_ERROR,
+		ERROR_CODE_HW_RIGHT_DOOR_ERROR,
+		ERROR_CODE_HW_CABIN_LIGHT_ERROR,
+		ERROR_CODE_HW_REAR_CAMERA_ERROR,
+		ERROR_CODE_HW_HORN_ERROR,
+	};
+	static_assert(sizeof(CFG_PortErrorCodes) == Outputs::CFG_PortCount, "Every port needs an error code");
+	
+	// Отключение порта защитой: ошибка порта с пиковым током в detail, 100 мА.
+	inline void OnOutputTrip(uint8_t num, uint16_t current)
+	{
+		uint16_t peak = current / 100;
+		RaiseError(CFG_PortErrorCodes[num - 1], (peak > 0xFF) ? 0xFF : peak);
+		
+		return;
+	}
+	
+	// Диагностика нагрузки порта: ошибка порта с Outputs::diag_t в detail.
+	inline void OnOutputDiag(uint8_t num, uint8_t diag)
+	{
+		RaiseError(CFG_PortErrorCodes[num - 1], diag);
+		
+		return;
+	}
+	
+	template <typename... Args>
+	inline void SetPowerBudget(Args... args)
+	{
+		const uint16_t values[] = { PowerBudget::stats.queued, PowerBudget::stats.forced, PowerBudget::stats.delay_max };
+		
+		return SetValues(obj_power_budget, 0, values, args...);
+	}
+	
+	// Отложенный пуск порта выполнен: ответ на команду включения событием объекта управления или ошибка порта.
+	// Пуски актуаторов сообщают о себе положением и событиями драйвера.
+	inline void OnBudgetDone(uint8_t load, PowerBudget::result_t result, bool forced)
+	{
+		if(forced == true)
+		{
+			SetPowerBudget(CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
+		}
+		
+		for(const output_binding_t &binding : CFG_OutputBindings)
+		{
+			if(PowerBudget::LOAD_PORT1 + binding.port - 1 != load) continue;
+			
+			if(result == PowerBudget::RESULT_STARTED)
 			{
-				TrunkHood::LogicSet(TrunkHood::driver2, TrunkHood::actuator_data[1], can_frame.data[0]);
-				obj_trunk_control.SetValue(0, can_frame.data[0], CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
-
-				return CAN_RESULT_IGNORE;
-			})
-			.RegisterFunctionToggle([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+				binding.control->SetValue(0, 1, CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
+			}
+			else
 			{
-				TrunkHood::LogicToggle(TrunkHood::driver2, TrunkHood::actuator_data[1]);
-				obj_trunk_control.SetValue(0, TrunkHood::actuator_data[1].state, CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
-
-				return CAN_RESULT_IGNORE;
-			});
+				RaiseError(binding.error_code, Outputs::DIAG_START_FAILED);
+			}
+		}
+		
+		return;
+	}
+	
+	// Здоровье шины из CANHealth: переход в error-passive или bus-off отправляется событием.
+	inline void OnHealthPublish(const uint8_t (&values)[CANHealth::HEALTH_COUNT], bool event)
+	{
+		if(event == true)
+		{
+			SetValues(obj_block_health, CANHealth::HEALTH_TEC, values, CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
+		}
+		else
+		{
+			SetValues(obj_block_health, CANHealth::HEALTH_TEC, values, CAN_TIMER_TYPE_NONE);
+		}
 		
+		return;
+	}
+	
+	/// @brief Publishes the selected latency page of CANStats to obj_can_latency.
+	template <typename... Args>
+	inline void SetLatency(Args... args)
+	{
+		const CANStats::latency_t &latency = CANStats::latency;
+		const uint16_t percentiles[] = { latency.p50, latency.p90, latency.p99 };
+		const uint16_t stages[] = { latency.stage[CANStats::STAMP_HANDLER], latency.stage[CANStats::STAMP_ACTION], latency.stage[CANStats::STAMP_TX_QUEUED] };
+		
+		return SetValues(obj_can_latency, 0, (latency_page == LATENCY_STAGES) ? stages : percentiles, args...);
+	}
+	
+	/// @brief Publishes positions of all actuators to obj_actuator_position.
+	template <typename... Args>
+	inline void SetPositions(Args... args)
+	{
+		uint8_t position[TrunkHood::CFG_ActuatorsCount];
+		for(uint8_t i = 0; i < TrunkHood::CFG_ActuatorsCount; ++i)
+		{
+			position[i] = TrunkHood::GetPosition(TrunkHood::actuators[i]);
+		}
+		
+		return SetValues(obj_actuator_position, 0, position, args...);
+	}
+	
+	/// @brief Samples currents and states of all PowerOut ports into obj_outputs_current.
+	/// @return true if a port changed state or its current changed by CFG_OutputsCurrentDelta or more since the last event.
+	inline bool SetOutputsCurrent()
+	{
+		static uint8_t last[Outputs::CFG_PortCount + 1] = {};
+		
+		uint8_t values[Outputs::CFG_PortCount + 1];
+		uint8_t &state = values[Outputs::CFG_PortCount];
+		state = 0;
+		
+		bool changed = false;
+		for(uint8_t i = 0; i < Outputs::CFG_PortCount; ++i)
+		{
+			uint16_t current = Outputs::outObj.GetCurrent(i + 1) / 50;
+			values[i] = (current > 0xFF) ? 0xFF : current;
+			if(Outputs::GetState(i + 1) == true) state |= (1 << i);
+			
+			if(abs(values[i] - last[i]) >= CFG_OutputsCurrentDelta) changed = true;
+		}
+		if(state != last[Outputs::CFG_PortCount]) changed = true;
 		
-		obj_hood_control
-			.RegisterFunctionSet([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+		if(changed == true)
+		{
+			memcpy(last, values, sizeof(last));
+			SetValues(obj_outputs_current, 0, values, CAN_TIMER_TYPE_NORMAL, CAN_EVENT_TYPE_NORMAL);
+		}
+		else
+		{
+			SetValues(obj_outputs_current, 0, values, CAN_TIMER_TYPE_NORMAL);
+		}
+		
+		return changed;
+	}
+	
+	/// @brief Binds actuator I to its driver callback and CAN control object from CFG_ActuatorBindings.
+	template <size_t I>
+	inline void RegisterActuator()
+	{
+		TrunkHood::actuators[I].driver.SetEventCallback([](uint8_t code)
+		{
+			OnActuatorEvent(TrunkHood::actuators[I], CFG_ActuatorBindings[I].error_code, code);
+		});
+		
+		CFG_ActuatorBindings[I].control
+			->RegisterFunctionSet([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
 			{
-				TrunkHood::LogicSet(TrunkHood::driver1, TrunkHood::actuator_data[0], can_frame.data[0]);
-				obj_hood_control.SetValue(0, can_frame.data[0], CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
+				actuator_command_t &command = actuator_commands[I];
+				
+				CANStats::Mark(CFG_ActuatorBindings[I].control->GetId(), CANStats::STAMP_HANDLER);
+				if(command.pending == true) ++commands_coalesced;
+				command.position = can_frame.data[0];
+				command.pending = true;
 
 				return CAN_RESULT_IGNORE;
 			})
 			.RegisterFunctionToggle([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
 			{
-				TrunkHood::LogicToggle(TrunkHood::driver1, TrunkHood::actuator_data[0]);
-				obj_hood_control.SetValue(0, TrunkHood::actuator_data[0].state, CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
+				// Переключение новее ожидающей команды джойстика и отменяет её.
+				actuator_commands[I].pending = false;
+				TrunkHood::LogicToggle(TrunkHood::actuators[I]);
+				CFG_ActuatorBindings[I].control->SetValue(0, TrunkHood::actuators[I].data.state, CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
 
 				return CAN_RESULT_IGNORE;
 			});
 		
+		return;
+	}
+	
+	/// @brief Applies the latest joystick command of every actuator. The reply event is sent only if the command changed something.
+	void ApplyActuatorCommands()
+	{
+		for(uint8_t i = 0; i < TrunkHood::CFG_ActuatorsCount; ++i)
+		{
+			actuator_command_t &command = actuator_commands[i];
+			if(command.pending == false) continue;
+			command.pending = false;
+			
+			CANObject<int8_t, 1> &obj = *CFG_ActuatorBindings[i].control;
+			if(TrunkHood::LogicSet(TrunkHood::actuators[i], command.position) == true)
+			{
+				CANStats::Mark(obj.GetId(), CANStats::STAMP_ACTION);
+				obj.SetValue(0, command.position, CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
+			}
+			else
+			{
+				obj.SetValue(0, command.position, CAN_TIMER_TYPE_NONE);
+			}
+		}
+		
+		return;
+	}
+	
+	template <size_t... I>
+	inline void RegisterActuators(std::index_sequence<I...>)
+	{
+		const int order[] = { (RegisterActuator<I>(), 0)... };
+		(void)order;
 		
-		obj_secelec_control
-			.RegisterFunctionSet([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+		return;
+	}
+	
+	/// @brief Binds output I to its CAN control object from CFG_OutputBindings.
+	template <size_t I>
+	inline void RegisterOutput()
+	{
+		CFG_OutputBindings[I].control
+			->RegisterFunctionSet([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
 			{
-				bool result = true;
-				if(can_frame.data[0] == 0)
+				const output_binding_t &binding = CFG_OutputBindings[I];
+				uint8_t value = can_frame.data[0];
+				
+				PowerBudget::result_t result = PowerBudget::RESULT_STARTED;
+				if(value == 0)
+				{
+					Outputs::SetOff(binding.port);
+				}
+				else if(binding.mode == OUTPUT_DIMMER)
 				{
-					Outputs::outObj.SetOff(1);
+					result = (Outputs::SetBrightness(value) == true) ? PowerBudget::RESULT_STARTED : PowerBudget::RESULT_FAILED;
 				}
 				else
 				{
-					result = Outputs::outObj.SetOn(1);
+					result = Outputs::SetOn(binding.port);
 				}
-
-				if (result)
+				
+				// Ответ на отложенный пуск отправляет OnBudgetDone() после пуска.
+				if(result == PowerBudget::RESULT_DEFERRED)
 				{
-					obj_secelec_control.SetValue(0, on_off_validator(can_frame.data[0]), CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
+					return CAN_RESULT_IGNORE;
+				}
+				if(result == PowerBudget::RESULT_STARTED)
+				{
+					binding.control->SetValue(0, (binding.mode == OUTPUT_DIMMER) ? value : on_off_validator(value), CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
 					return CAN_RESULT_IGNORE;
 				}
 				
 				error.error_section = ERROR_SECTION_HARDWARE;
-				error.error_code = ERROR_CODE_HW_SECONDARY_ELECTRONICS_ERROR;
+				error.error_code = binding.error_code;
 				return CAN_RESULT_ERROR;
 			})
 			.RegisterFunctionToggle([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
 			{
-				Outputs::outObj.SetToggle(1);
-				obj_secelec_control.SetValue(0, Outputs::outObj.GetState(1), CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
+				const output_binding_t &binding = CFG_OutputBindings[I];
+				
+				Outputs::SetToggle(binding.port);
+				binding.control->SetValue(0, (binding.mode == OUTPUT_DIMMER) ? Outputs::GetBrightness() : Outputs::GetState(binding.port), CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
 				
 				return CAN_RESULT_IGNORE;
 			});
 		
+		return;
+	}
+	
+	template <size_t... I>
+	inline void RegisterOutputs(std::index_sequence<I...>)
+	{
+		const int order[] = { (RegisterOutput<I>(), 0)... };
+		(void)order;
 		
-		obj_leftdoor_control.RegisterFunctionAction([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+		return;
+	}
+	
+	inline void Setup()
+	{
+		RegisterActuators(std::make_index_sequence<TrunkHood::CFG_ActuatorsCount>());
+		RegisterOutputs(std::make_index_sequence<CFG_OutputBindingsCount>());
+		Outputs::SetTripEvent(OnOutputTrip);
+		Outputs::SetDiagEvent(OnOutputDiag);
+		CANHealth::SetPublishEvent(OnHealthPublish);
+		PowerBudget::SetDoneEvent(OnBudgetDone);
+		
+		obj_energy_stats.RegisterFunctionSet([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
 		{
-			Outputs::outObj.SetOn(2, 1000);
+			uint8_t load = can_frame.data[0];
+			uint8_t counter = can_frame.data[1];
+			if(load >= PowerBudget::LOAD_COUNT || counter >= EnergyStats::COUNTER_COUNT)
+			{
+				error.error_section = ERROR_SECTION_HARDWARE;
+				error.error_code = ERROR_CODE_HW_NONE;
+				return CAN_RESULT_ERROR;
+			}
 			
-			can_frame.initialized = true;
-			can_frame.function_id = CAN_FUNC_EVENT_OK;
+			const uint8_t selector[] = { load, counter };
+			SetValues(obj_energy_stats, 0, selector, CAN_TIMER_TYPE_NONE);
+			SetBytes(obj_energy_stats, 2, EnergyStats::GetCounter(load, counter), CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
 			
-			return CAN_RESULT_CAN_FRAME;
+			return CAN_RESULT_IGNORE;
 		});
 		
-		
-		obj_rightdoor_control.RegisterFunctionAction([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+		obj_can_latency.RegisterFunctionSet([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
 		{
-			Outputs::outObj.SetOn(3, 1000);
+			if(can_frame.data[0] >= LATENCY_PAGE_COUNT)
+			{
+				error.error_section = ERROR_SECTION_HARDWARE;
+				error.error_code = ERROR_CODE_HW_NONE;
+				return CAN_RESULT_ERROR;
+			}
 			
-			can_frame.initialized = true;
-			can_frame.function_id = CAN_FUNC_EVENT_OK;
+			latency_page = can_frame.data[0];
+			SetLatency(CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
 			
-			return CAN_RESULT_CAN_FRAME;
+			return CAN_RESULT_IGNORE;
 		});
 		
-		
-		obj_cabinlight_control
-			.RegisterFunctionSet([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+		obj_output_pattern.RegisterFunctionSet([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+		{
+			uint8_t port = can_frame.data[0];
+			uint8_t pattern = can_frame.data[1];
+			if(Outputs::RunPattern(port, pattern) == false)
 			{
-				bool result = true;
-				if(can_frame.data[0] == 0)
-				{
-					Outputs::outObj.SetOff(4);
-				}
-				else
-				{
-					result = Outputs::outObj.SetOn(4);
-				}
-
-				if (result)
-				{
-					obj_cabinlight_control.SetValue(0, on_off_validator(can_frame.data[0]), CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
-					return CAN_RESULT_IGNORE;
-				}
-				
 				error.error_section = ERROR_SECTION_HARDWARE;
-				error.error_code = ERROR_CODE_HW_CABIN_LIGHT_ERROR;
+				error.error_code = (port > 0 && port <= Outputs::CFG_PortCount) ? (uint8_t)CFG_PortErrorCodes[port - 1] : (uint8_t)ERROR_CODE_HW_NONE;
 				return CAN_RESULT_ERROR;
-			})
-			.RegisterFunctionToggle([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+			}
+			
+			const uint8_t values[] = { port, pattern };
+			SetValues(obj_output_pattern, 0, values, CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
+			
+			return CAN_RESULT_IGNORE;
+		});
+		
+		obj_parking_mode.RegisterFunctionSet([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+		{
+			bool enter = can_frame.data[0] > 0;
+			Parking::Request(enter);
+			obj_parking_mode.SetValue(0, enter, CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
+			
+			return CAN_RESULT_IGNORE;
+		});
+		
+		obj_actuator_position.RegisterFunctionSet([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+		{
+			for(uint8_t i = 0; i < TrunkHood::CFG_ActuatorsCount; ++i)
 			{
-				Outputs::outObj.SetToggle(4);
-				obj_cabinlight_control.SetValue(0, Outputs::outObj.GetState(4), CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
-				
-				return CAN_RESULT_IGNORE;
-			});
+				TrunkHood::LogicTarget(TrunkHood::actuators[i], can_frame.data[i]);
+			}
+			SetPositions(CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
+			
+			return CAN_RESULT_IGNORE;
+		});
 		
-		obj_rearcamera_control
-			.RegisterFunctionSet([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+		
+		obj_leftdoor_control.RegisterFunctionAction([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+		{
+			// Порт отключён защитой: замок не открыт.
+			if(Outputs::RunPattern(2, Outputs::PATTERN_PULSE) == false)
 			{
-				bool result = true;
-				if(can_frame.data[0] == 0)
-				{
-					Outputs::outObj.SetOff(5);
-				}
-				else
-				{
-					result = Outputs::outObj.SetOn(5);
-				}
-
-				if (result)
-				{
-					obj_rearcamera_control.SetValue(0, on_off_validator(can_frame.data[0]), CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
-					return CAN_RESULT_IGNORE;
-				}
-				
 				error.error_section = ERROR_SECTION_HARDWARE;
-				error.error_code = ERROR_CODE_HW_REAR_CAMERA_ERROR;
+				error.error_code = CFG_PortErrorCodes[2 - 1];
 				return CAN_RESULT_ERROR;
-			})
-			.RegisterFunctionToggle([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
-			{
-				Outputs::outObj.SetToggle(5);
-				obj_rearcamera_control.SetValue(0, Outputs::outObj.GetState(5), CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
-				
-				return CAN_RESULT_IGNORE;
-			});
+			}
+			
+			can_frame.initialized = true;
+			can_frame.function_id = CAN_FUNC_EVENT_OK;
+			
+			return CAN_RESULT_CAN_FRAME;
+		});
 		
-
-		obj_horn_control
-			.RegisterFunctionSet([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+		
+		obj_rightdoor_control.RegisterFunctionAction([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
+		{
+			// Порт отключён защитой: замок не открыт.
+			if(Outputs::RunPattern(3, Outputs::PATTERN_PULSE) == false)
 			{
-				bool result = true;
-				if(can_frame.data[0] == 0)
-				{
-					Outputs::outObj.SetOff(6);
-				}
-				else
-				{
-					result = Outputs::outObj.SetOn(6);
-				}
-
-				if (result)
-				{
-					obj_horn_control.SetValue(0, on_off_validator(can_frame.data[0]), CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
-					return CAN_RESULT_IGNORE;
-				}
-				
 				error.error_section = ERROR_SECTION_HARDWARE;
-				error.error_code = ERROR_CODE_HW_HORN_ERROR;
+				error.error_code = CFG_PortErrorCodes[3 - 1];
 				return CAN_RESULT_ERROR;
-			})
-			.RegisterFunctionToggle([](can_frame_t &can_frame, can_error_t &error) -> can_result_t
-			{
-				Outputs::outObj.SetToggle(6);
-				obj_horn_control.SetValue(0, Outputs::outObj.GetState(6), CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
-				
-				return CAN_RESULT_IGNORE;
-			});
+			}
+			
+			can_frame.initialized = true;
+			can_frame.function_id = CAN_FUNC_EVENT_OK;
+			
+			return CAN_RESULT_CAN_FRAME;
+		});
 		
 		
 		// system blocks
@@ -322,18 +706,28 @@ namespace CANLib
 		can_manager.RegisterObject(obj_block_error);
 
 		// specific blocks
-		can_manager.RegisterObject(obj_trunk_control);
-		can_manager.RegisterObject(obj_hood_control);
-		can_manager.RegisterObject(obj_secelec_control);
+		for(const actuator_binding_t &binding : CFG_ActuatorBindings)
+		{
+			can_manager.RegisterObject(*binding.control);
+		}
+		for(const output_binding_t &binding : CFG_OutputBindings)
+		{
+			can_manager.RegisterObject(*binding.control);
+		}
 		can_manager.RegisterObject(obj_leftdoor_control);
 		can_manager.RegisterObject(obj_rightdoor_control);
-		can_manager.RegisterObject(obj_cabinlight_control);
-		can_manager.RegisterObject(obj_rearcamera_control);
-		can_manager.RegisterObject(obj_horn_control);
+		can_manager.RegisterObject(obj_can_latency);
+		can_manager.RegisterObject(obj_actuator_position);
+		can_manager.RegisterObject(obj_outputs_current);
+		can_manager.RegisterObject(obj_energy_stats);
+		can_manager.RegisterObject(obj_output_pattern);
+		can_manager.RegisterObject(obj_parking_mode);
+		can_manager.RegisterObject(obj_can_errors);
+		can_manager.RegisterObject(obj_power_budget);
 
 		// Set versions data to block_info.
-		obj_block_info.SetValue(0, (About::board_type << 3 | About::board_ver), CAN_TIMER_TYPE_NORMAL);
-		obj_block_info.SetValue(1, (About::soft_ver << 2 | About::can_ver), CAN_TIMER_TYPE_NORMAL);
+		const uint8_t versions[] = { (About::board_type << 3 | About::board_ver), (About::soft_ver << 2 | About::can_ver) };
+		SetValues(obj_block_info, 0, versions, CAN_TIMER_TYPE_NORMAL);
 		
 		return;
 	}
@@ -341,6 +735,13 @@ namespace CANLib
 	inline void Loop(uint32_t &current_time)
 	{
 		can_manager.Process(current_time);
+		ApplyActuatorCommands();
+		
+		// После пробуждения запрос стоянки снят.
+		if(Parking::IsRequested() == false && obj_parking_mode.GetValue(0) != 0)
+		{
+			obj_parking_mode.SetValue(0, 0, CAN_TIMER_TYPE_NONE);
+		}
 		
 		// Set uptime to block_info.
 		static uint32_t iter = 0;
@@ -348,11 +749,49 @@ namespace CANLib
 		{
 			iter = current_time;
 
-			uint8_t *data = (uint8_t *)&current_time;
-			obj_block_info.SetValue(2, data[0], CAN_TIMER_TYPE_NORMAL);
-			obj_block_info.SetValue(3, data[1], CAN_TIMER_TYPE_NORMAL);
-			obj_block_info.SetValue(4, data[2], CAN_TIMER_TYPE_NORMAL);
-			obj_block_info.SetValue(5, data[3], CAN_TIMER_TYPE_NORMAL);
+			SetBytes(obj_block_info, 2, current_time, CAN_TIMER_TYPE_NORMAL);
+
+			// Set command latency percentiles or stages.
+			SetLatency(CAN_TIMER_TYPE_NONE);
+			
+			// Set bus error statistics.
+			uint8_t errors[CANHealth::ERRORS_COUNT];
+			CANHealth::GetErrors(errors);
+			SetValues(obj_can_errors, 0, errors, CAN_TIMER_TYPE_NONE);
+			
+			// Set deferred start statistics.
+			SetPowerBudget(CAN_TIMER_TYPE_NONE);
+		}
+		
+		// Homing start and finish are sent as events.
+		static uint8_t homing_mask = 0;
+		uint8_t mask = 0;
+		for(uint8_t i = 0; i < TrunkHood::CFG_ActuatorsCount; ++i)
+		{
+			if(TrunkHood::IsHoming(TrunkHood::actuators[i]) == true) mask |= (1 << i);
+		}
+		if(mask != homing_mask)
+		{
+			homing_mask = mask;
+			SetPositions(CAN_TIMER_TYPE_NONE, CAN_EVENT_TYPE_NORMAL);
+		}
+		
+		// Set actuators position.
+		static uint32_t position_iter = 0;
+		if(current_time - position_iter > 250)
+		{
+			position_iter = current_time;
+			
+			SetPositions(CAN_TIMER_TYPE_NONE);
+		}
+		
+		// Set outputs current, significant changes are sent as events.
+		static uint32_t outputs_iter = 0;
+		if(current_time - outputs_iter > CFG_OutputsCurrentSample)
+		{
+			outputs_iter = current_time;
+			
+			SetOutputsCurrent();
 		}
 		
 		current_time = HAL_GetTick();
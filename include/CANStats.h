@@ -0,0 +1,242 @@
+#pragma once
+
+#include <string.h>
+#include <CANLibrary.h>
+
+namespace CANStats
+{
+	static constexpr uint32_t CFG_Bitrate = 500000;			// Скорость шины, бит/с.
+	static constexpr uint16_t CFG_LoadWindow = 1000;		// Окно подсчёта загрузки шины, мс.
+	static constexpr uint16_t CFG_MeasureTimeout = 100;		// Время, после которого незавершённое измерение сбрасывается, мс.
+	static constexpr uint8_t CFG_SampleCount = 64;			// Кол-во последних измерений задержки для расчёта перцентилей.
+
+	// Объекты, для которых измеряется задержка от приёма команды до отправки ответа.
+	static constexpr can_object_id_t CFG_TrackedIds[] = { 0x0184, 0x0185 };
+
+	enum stamp_t : uint8_t { STAMP_RX, STAMP_HANDLER, STAMP_ACTION, STAMP_TX_QUEUED, STAMP_TX_DONE, STAMP_MAX };
+
+	struct measure_t
+	{
+		can_object_id_t id;				// Объект, по которому идёт измерение, 0 - измерения нет.
+		uint32_t mailbox;				// Почтовый ящик, в который поставлен ответ.
+		uint32_t stamp[STAMP_MAX];		// Метки времени этапов, такты DWT.
+		uint32_t start_tick;			// HAL_GetTick() на момент приёма.
+	};
+
+	struct latency_t
+	{
+		uint16_t p50;				// Медиана полной задержки, мкс.
+		uint16_t p90;				// 90-й перцентиль, мкс.
+		uint16_t p99;				// 99-й перцентиль, мкс.
+		uint16_t stage[STAMP_MAX];	// Средняя длительность этапов относительно STAMP_RX, мкс.
+		uint32_t count;				// Кол-во завершённых измерений за всё время.
+	};
+
+	volatile measure_t measure = {};
+
+	uint16_t samples[CFG_SampleCount] = {};
+	uint16_t sorted[CFG_SampleCount];
+	uint32_t stage_sum[STAMP_MAX] = {};		// Сумма длительностей этапов за окно, мкс.
+	uint16_t stage_count = 0;				// Кол-во измерений за окно.
+	uint8_t sample_idx = 0;
+	uint8_t sample_count = 0;
+
+	latency_t latency = {};
+
+	volatile uint32_t window_bits = 0;		// Кол-во бит, переданных по шине в текущем окне.
+	volatile uint16_t window_frames = 0;	// Кол-во кадров в текущем окне.
+	uint16_t bus_load = 0;					// Сглаженная загрузка шины, десятые доли процента.
+	uint16_t frames_per_second = 0;
+
+
+	inline uint32_t Cycles()
+	{
+		return DWT->CYCCNT;
+	}
+
+	inline uint32_t CyclesToUs(uint32_t cycles)
+	{
+		return cycles / (SystemCoreClock / 1000000);
+	}
+
+	// Длина стандартного кадра в битах с учётом худшего случая bit-stuffing.
+	inline uint32_t FrameBits(uint8_t dlc)
+	{
+		uint32_t bits = 47 + 8 * dlc;
+
+		return bits + (34 + 8 * dlc - 1) / 4;
+	}
+
+	inline bool IsTracked(can_object_id_t id)
+	{
+		for(can_object_id_t tracked : CFG_TrackedIds)
+		{
+			if(tracked == id) return true;
+		}
+
+		return false;
+	}
+
+	// Вызывается из прерывания RX FIFO.
+	inline void OnRxFrame(can_object_id_t id, uint8_t dlc)
+	{
+		window_bits += FrameBits(dlc);
+		++window_frames;
+
+		if(measure.id == 0 && IsTracked(id) == true)
+		{
+			uint32_t now = Cycles();
+			for(uint8_t i = 0; i < STAMP_MAX; ++i)
+			{
+				measure.stamp[i] = now;
+			}
+			measure.start_tick = HAL_GetTick();
+			measure.mailbox = 0;
+			measure.id = id;
+		}
+
+		return;
+	}
+
+	// Отметка этапа обработки команды, вызывается из обработчиков CAN объектов.
+	inline void Mark(can_object_id_t id, stamp_t stamp)
+	{
+		if(measure.id != id) return;
+
+		measure.stamp[stamp] = Cycles();
+
+		return;
+	}
+
+	// Вызывается после постановки кадра в почтовый ящик. Загрузка шины считается по завершению передачи.
+	inline void OnTxFrame(can_object_id_t id, uint32_t mailbox)
+	{
+		if(measure.id == id && measure.mailbox == 0)
+		{
+			measure.stamp[STAMP_TX_QUEUED] = Cycles();
+			measure.mailbox = mailbox;
+		}
+
+		return;
+	}
+
+	void AddSample()
+	{
+		uint32_t rx = measure.stamp[STAMP_RX];
+		uint32_t total = CyclesToUs(measure.stamp[STAMP_TX_DONE] - rx);
+
+		samples[sample_idx] = (total > 0xFFFF) ? 0xFFFF : total;
+		sample_idx = (sample_idx + 1) % CFG_SampleCount;
+		if(sample_count < CFG_SampleCount) ++sample_count;
+
+		for(uint8_t i = STAMP_HANDLER; i < STAMP_MAX; ++i)
+		{
+			stage_sum[i] += CyclesToUs(measure.stamp[i] - rx);
+		}
+		++stage_count;
+		++latency.count;
+
+		return;
+	}
+
+	// Вызывается из прерывания завершения передачи, dlc - из регистра почтового ящика.
+	inline void OnTxComplete(uint32_t mailbox, uint8_t dlc)
+	{
+		window_bits += FrameBits(dlc);
+		++window_frames;
+
+		if(measure.id == 0 || measure.mailbox != mailbox) return;
+
+		measure.stamp[STAMP_TX_DONE] = Cycles();
+		AddSample();
+		measure.id = 0;
+
+		return;
+	}
+
+	// Вызывается с копией samples в sorted, сортирует её на месте.
+	void CalcPercentiles(uint8_t count)
+	{
+		if(count == 0) return;
+
+		// Сортировка вставками, объём небольшой и считается раз в окно.
+		for(uint8_t i = 1; i < count; ++i)
+		{
+			uint16_t value = sorted[i];
+			uint8_t j = i;
+			for(; j > 0 && sorted[j - 1] > value; --j)
+			{
+				sorted[j] = sorted[j - 1];
+			}
+			sorted[j] = value;
+		}
+
+		latency.p50 = sorted[(count * 50) / 100];
+		latency.p90 = sorted[(count * 90) / 100];
+		latency.p99 = sorted[(count * 99) / 100];
+
+		return;
+	}
+
+	inline void Setup()
+	{
+		CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+		DWT->CYCCNT = 0;
+		DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+		return;
+	}
+
+	inline void Loop(uint32_t &current_time)
+	{
+		// Ответ не ушёл (ошибка передачи или команда без ответа).
+		__disable_irq();
+		if(measure.id != 0 && current_time - measure.start_tick > CFG_MeasureTimeout)
+		{
+			measure.id = 0;
+		}
+		__enable_irq();
+
+		static uint32_t last_time = 0;
+		if(current_time - last_time >= CFG_LoadWindow)
+		{
+			uint32_t elapsed = current_time - last_time;
+			last_time = current_time;
+
+			__disable_irq();
+			uint32_t bits = window_bits;
+			uint16_t frames = window_frames;
+			window_bits = 0;
+			window_frames = 0;
+
+			uint8_t count = sample_count;
+			memcpy(sorted, samples, sizeof(samples));
+
+			uint32_t stage_avg[STAMP_MAX] = {};
+			for(uint8_t i = STAMP_HANDLER; i < STAMP_MAX && stage_count > 0; ++i)
+			{
+				stage_avg[i] = stage_sum[i] / stage_count;
+				stage_sum[i] = 0;
+			}
+			bool stages = (stage_count > 0);
+			stage_count = 0;
+			__enable_irq();
+
+			// Загрузка в десятых долях процента, сглаживание 1/4.
+			uint32_t load = (bits * 1000 / elapsed) / (CFG_Bitrate / 1000);
+			if(load > 1000) load = 1000;
+			bus_load = (bus_load * 3 + load) / 4;
+			frames_per_second = (uint32_t)frames * 1000 / elapsed;
+
+			CalcPercentiles(count);
+			for(uint8_t i = STAMP_HANDLER; i < STAMP_MAX && stages == true; ++i)
+			{
+				latency.stage[i] = (stage_avg[i] > 0xFFFF) ? 0xFFFF : stage_avg[i];
+			}
+		}
+
+		current_time = HAL_GetTick();
+
+		return;
+	}
+}
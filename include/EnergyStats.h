@@ -0,0 +1,159 @@
+#pragma once
+
+/*
+	Учёт энергии нагрузок: заряд, время во включённом состоянии и кол-во включений
+	каждого порта PowerOut и каждого актуатора. Индекс нагрузки - PowerBudget::load_id_t.
+	Счётчики по желанию сохраняются во flash и переживают перезагрузку.
+*/
+
+#include <FlashStorage.h>
+
+extern CAN_HandleTypeDef hcan;
+
+namespace EnergyStats
+{
+	static constexpr uint32_t CFG_SampleInterval = 100;			// Период отсчётов тока, мс.
+	static constexpr uint32_t CFG_SnapshotInterval = 600000;	// Период сохранения счётчиков во flash, мс. 0 - не сохранять.
+	static constexpr uint32_t CFG_StoragePage0 = 0x0800F000;	// Страницы flash для счётчиков (страницы 60 и 61, вне образа прошивки).
+	static constexpr uint32_t CFG_StoragePage1 = 0x0800F400;
+	static constexpr uint32_t CFG_BusQuietTime = 20;			// Время без принятых кадров, после которого разрешена запись во flash, мс.
+
+	static constexpr uint32_t CFG_ChargeUnit = 3600000;			// мА*мс в 1 мАч.
+
+	// Счётчики, отдаваемые в CAN.
+	enum counter_id_t : uint8_t { COUNTER_CHARGE, COUNTER_ON_TIME, COUNTER_SWITCHES, COUNTER_COUNT };
+
+	struct counter_t
+	{
+		uint32_t charge;			// Заряд, мАч.
+		uint32_t charge_rest;		// Остаток заряда меньше 1 мАч, мА*мс.
+		uint32_t on_time;			// Время во включённом состоянии, с.
+		uint16_t on_time_rest;		// Остаток времени меньше 1 с, мс.
+		uint16_t reserved;
+		uint32_t switches;			// Кол-во включений.
+	};
+
+	struct snapshot_t
+	{
+		counter_t counters[PowerBudget::LOAD_COUNT];
+	};
+
+	snapshot_t data = {};
+	bool state[PowerBudget::LOAD_COUNT] = {};		// Нагрузка включена на последнем отсчёте.
+
+	FlashStorage<snapshot_t> storage(CFG_StoragePage0, CFG_StoragePage1, FLASH_PAGE_SIZE);
+	// Страницы лежат за концом образа прошивки, FLASH_IMAGE_SIZE задаётся в platformio.ini.
+	static_assert(CFG_StoragePage0 >= FLASH_BASE + FLASH_IMAGE_SIZE && CFG_StoragePage1 >= FLASH_BASE + FLASH_IMAGE_SIZE, "EnergyStats storage pages overlap the firmware image");
+
+	volatile uint32_t last_rx = 0;		// Время последнего принятого кадра.
+
+
+	void Account(uint8_t load, uint16_t current, bool on, uint32_t dt)
+	{
+		counter_t &counter = data.counters[load];
+
+		// Заряд считается и у выключенной нагрузки, так видны паразитные утечки.
+		counter.charge_rest += current * dt;
+		counter.charge += counter.charge_rest / CFG_ChargeUnit;
+		counter.charge_rest %= CFG_ChargeUnit;
+
+		if(on == true)
+		{
+			uint32_t on_time = counter.on_time_rest + dt;
+			counter.on_time += on_time / 1000;
+			counter.on_time_rest = on_time % 1000;
+
+			if(state[load] == false) ++counter.switches;
+		}
+		state[load] = on;
+
+		return;
+	}
+
+	uint32_t GetCounter(uint8_t load, uint8_t counter)
+	{
+		if(load >= PowerBudget::LOAD_COUNT) return 0;
+
+		switch(counter)
+		{
+			case COUNTER_CHARGE: { return data.counters[load].charge; }
+			case COUNTER_ON_TIME: { return data.counters[load].on_time; }
+			case COUNTER_SWITCHES: { return data.counters[load].switches; }
+			default: { return 0; }
+		}
+	}
+
+	// Вызывается из прерывания RX FIFO.
+	inline void OnRxFrame()
+	{
+		last_rx = HAL_GetTick();
+
+		return;
+	}
+
+	// На время стирания и программирования flash ядро стоит и прерывания CAN не обслуживаются, кадры копятся
+	// только в трёх ячейках RX FIFO. Запись - в паузе приёма и когда все ответы уже отправлены.
+	// last_rx меняется в прерывании и может быть новее current_time.
+	bool IsBusQuiet(uint32_t current_time)
+	{
+		return (int32_t)(current_time - last_rx) >= (int32_t)CFG_BusQuietTime && HAL_CAN_GetTxMailboxesFreeLevel(&hcan) == 3;
+	}
+
+	// Запись во flash останавливает процессор на время программирования, поэтому не выполняется на ходу актуаторов.
+	bool IsIdle()
+	{
+		for(TrunkHood::actuator_t &actuator : TrunkHood::actuators)
+		{
+			DRV8874::direction_t dir = actuator.driver.GetState();
+			if(dir == DRV8874::DIR_LEFT || dir == DRV8874::DIR_RIGHT || actuator.driver.IsReversing() == true) return false;
+		}
+
+		return true;
+	}
+
+	inline void Setup()
+	{
+		// Пометка dirty не используется: снимок всегда считается действительным.
+		bool clean;
+		if(CFG_SnapshotInterval > 0)
+		{
+			storage.Load(data, clean);
+		}
+
+		return;
+	}
+
+	inline void Loop(uint32_t &current_time)
+	{
+		static uint32_t last_sample = 0;
+		uint32_t dt = current_time - last_sample;
+		if(dt >= CFG_SampleInterval)
+		{
+			last_sample = current_time;
+
+			for(uint8_t i = 0; i < TrunkHood::CFG_ActuatorsCount; ++i)
+			{
+				TrunkHood::actuator_t &actuator = TrunkHood::actuators[i];
+				DRV8874::direction_t dir = actuator.driver.GetState();
+
+				Account(actuator.config.load, actuator.driver.GetCurrent(), (dir == DRV8874::DIR_LEFT || dir == DRV8874::DIR_RIGHT), dt);
+			}
+			for(uint8_t num = 1; num <= Outputs::CFG_PortCount; ++num)
+			{
+				Account(PowerBudget::LOAD_PORT1 + num - 1, Outputs::outObj.GetCurrent(num), Outputs::GetState(num), dt);
+			}
+		}
+
+		static uint32_t last_snapshot = 0;
+		if(CFG_SnapshotInterval > 0 && current_time - last_snapshot >= CFG_SnapshotInterval && IsIdle() == true && IsBusQuiet(current_time) == true)
+		{
+			last_snapshot = current_time;
+
+			storage.Save(data);
+		}
+
+		current_time = HAL_GetTick();
+
+		return;
+	}
+}
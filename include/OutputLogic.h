@@ -1,6 +1,11 @@
 #pragma once
 
 #include  <PowerOut.h>
+#include <PowerBudget.h>
+
+extern ADC_HandleTypeDef hadc2;
+extern TIM_HandleTypeDef htim1;
+extern TIM_HandleTypeDef htim4;
 
 namespace Outputs
 {
@@ -9,24 +14,504 @@ namespace Outputs
 	static constexpr uint32_t CFG_RefVoltage = 3324000;	// Опорное напряжение, микровольты.
 	static constexpr uint8_t CFG_INA180_Gain = 50;		// Усиление микросхемы INA180.
 	static constexpr uint8_t CFG_ShuntResistance = 5;	// Сопротивление шунта, миллиомы.
+	static constexpr uint16_t CFG_TripCurrent = 12000;	// Ток аппаратного отключения порта (КЗ), мА.
+	static constexpr uint8_t CFG_DimmerPort = 4;		// Порт с ШИМ диммером (свет в салоне, PB13 = TIM1_CH1N).
+	static constexpr uint16_t CFG_FadeInTime = 500;		// Время плавного включения от 0 до полной яркости, мс.
+	static constexpr uint16_t CFG_FadeOutTime = 1000;	// Время плавного выключения от полной яркости до 0, мс.
+	static constexpr uint16_t CFG_DiagDelay = 300;		// Время от включения порта до начала проверки тока нагрузки, мс.
+	static constexpr uint16_t CFG_DiagInterval = 50;	// Период проверки тока нагрузки, мс.
+	static constexpr uint8_t CFG_DiagConfirm = 3;		// Кол-во проверок подряд для сообщения о нагрузке.
 	/* */
 	
+	struct port_t
+	{
+		GPIO_TypeDef *port;
+		uint16_t pin;
+		uint16_t channel;		// Канал АЦП датчика тока.
+		uint16_t limit;			// Ток программного отключения PowerOut, мА.
+		uint16_t open;			// Ниже этого тока нагрузка оборвана, мА. 0 - без диагностики.
+		uint16_t min;			// Ниже этого тока нагрузка деградировала, мА.
+		uint16_t max;			// Выше этого тока нагрузка перегружена, мА.
+	};
+	
+	static const port_t CFG_Ports[CFG_PortCount] = 
+	{
+		{ GPIOA, GPIO_PIN_8,  ADC_CHANNEL_6, 5000,  50,  200,  3000 },	// Вторичная электроника.
+		{ GPIOB, GPIO_PIN_15, ADC_CHANNEL_5, 5000,  200, 1000, 4500 },	// Замок левой двери.
+		{ GPIOB, GPIO_PIN_14, ADC_CHANNEL_4, 5000,  200, 1000, 4500 },	// Замок правой двери.
+		{ GPIOB, GPIO_PIN_13, ADC_CHANNEL_3, 5000,  50,  300,  3000 },	// Свет в салоне, проверяется на полной яркости.
+		{ GPIOB, GPIO_PIN_12, ADC_CHANNEL_2, 5000,  30,  100,  1000 },	// Камера заднего вида.
+		{ GPIOB, GPIO_PIN_2,  ADC_CHANNEL_1, 10000, 300, 2000, 8000 },	// Клаксон.
+	};
+	
+	// Шаблоны выходов: байткод из пар { команда, аргумент }, исполняется в PatternIRQ() по тику TIM4.
+	enum pattern_op_t : uint8_t
+	{
+		OP_END,			// Конец шаблона, порт выключается.
+		OP_ON,			// Включить порт.
+		OP_OFF,			// Выключить порт.
+		OP_WAIT,		// Пауза, аргумент - время в 10 мс (до 2,55 с).
+		OP_REPEAT,		// Начало повтора, аргумент - кол-во проходов, 0 - без конца. Без вложенности.
+		OP_NEXT,		// Конец повтора.
+	};
+	
+	static constexpr uint8_t CFG_PatternPulse[] = { OP_ON, 0, OP_WAIT, 100, OP_END, 0 };
+	static constexpr uint8_t CFG_PatternRetry[] = { OP_ON, 0, OP_WAIT, 50, OP_OFF, 0, OP_WAIT, 30, OP_ON, 0, OP_WAIT, 80, OP_OFF, 0, OP_WAIT, 50, OP_ON, 0, OP_WAIT, 120, OP_END, 0 };
+	static constexpr uint8_t CFG_PatternChirp[] = { OP_ON, 0, OP_WAIT, 5, OP_END, 0 };
+	static constexpr uint8_t CFG_PatternDoubleChirp[] = { OP_REPEAT, 2, OP_ON, 0, OP_WAIT, 5, OP_OFF, 0, OP_WAIT, 15, OP_NEXT, 0, OP_END, 0 };
+	static constexpr uint8_t CFG_PatternBlink[] = { OP_REPEAT, 0, OP_ON, 0, OP_WAIT, 25, OP_OFF, 0, OP_WAIT, 50, OP_NEXT, 0 };
+	
+	enum pattern_id_t : uint8_t
+	{
+		PATTERN_NONE,			// Остановить шаблон.
+		PATTERN_PULSE,			// Импульс 1 с: открытие замка двери.
+		PATTERN_RETRY,			// Открытие замка с повторами 500, 800 и 1200 мс.
+		PATTERN_CHIRP,			// Короткий сигнал клаксона 50 мс.
+		PATTERN_DOUBLE_CHIRP,	// Двойной сигнал клаксона.
+		PATTERN_BLINK,			// Мигание 250 / 500 мс до остановки.
+		PATTERN_COUNT
+	};
+	
+	// Порядок совпадает с pattern_id_t.
+	static constexpr const uint8_t *CFG_Patterns[] = { nullptr, CFG_PatternPulse, CFG_PatternRetry, CFG_PatternChirp, CFG_PatternDoubleChirp, CFG_PatternBlink };
+	static_assert(sizeof(CFG_Patterns) / sizeof(CFG_Patterns[0]) == PATTERN_COUNT, "Every pattern needs a program");
+	
+	struct pattern_state_t
+	{
+		const uint8_t * volatile program;	// Исполняемый шаблон, nullptr - нет.
+		uint8_t pc;				// Смещение следующей команды.
+		uint8_t loop_pc;		// Смещение первой команды повтора.
+		uint8_t loop_count;		// Оставшиеся проходы повтора.
+		uint16_t delay;			// Оставшаяся пауза, мс.
+	};
+	
+	// Диагностика нагрузки, передаётся в detail ошибки порта. Пиковый ток отключения защитой
+	// там же не меньше 50 (100 мА), поэтому коды не пересекаются.
+	// DIAG_START_FAILED - отложенный PowerBudget пуск не выполнен.
+	enum diag_t : uint8_t { DIAG_OK = 0x00, DIAG_OPEN = 0x01, DIAG_DEGRADED = 0x02, DIAG_OVERLOAD = 0x03, DIAG_START_FAILED = 0x04 };
+	
+	using diag_event_t = void (*)(uint8_t num, uint8_t diag);
+	
+	struct diag_state_t
+	{
+		uint32_t on_time;		// Время включения порта.
+		bool on;
+		uint8_t last;			// Последний результат проверки.
+		uint8_t hits;			// Кол-во проверок подряд с этим результатом.
+		uint8_t reported;		// Сообщённый результат, сбрасывается при выключении.
+	};
+	
+	// Отсчёты АЦП по току, мА: U = I * R * gain.
+	static constexpr uint16_t CurrentToADC(uint32_t current)
+	{
+		return ((uint64_t)current * CFG_ShuntResistance * CFG_INA180_Gain * 4095) / CFG_RefVoltage;
+	}
+	
+	static constexpr uint16_t ADCToCurrent(uint32_t adc)
+	{
+		return ((uint64_t)adc * CFG_RefVoltage) / (4095 * CFG_ShuntResistance * CFG_INA180_Gain);
+	}
+	
+	// Ошибка порта: аппаратное отключение по КЗ или отключение PowerOut. current - пиковый ток, мА.
+	using trip_event_t = void (*)(uint8_t num, uint16_t current);
+	
+	struct trip_t
+	{
+		volatile bool latched;		// Порт отключён защитой, включение запрещено до SetOff().
+		volatile bool pending;		// Отключение ещё не обработано в Loop().
+		volatile uint16_t peak;		// Пиковый ток, мА.
+	};
+	
 	PowerOut<CFG_PortCount> outObj(CFG_RefVoltage, CFG_INA180_Gain, CFG_ShuntResistance);
 	
+	// Уровни диммера хранятся в скважности * 256, чтобы шаг плавного изменения за 1 мс не терялся.
+	struct dimmer_t
+	{
+		volatile uint32_t level;	// Текущий уровень, меняется в FadeIRQ().
+		volatile uint32_t target;	// Целевой уровень.
+		uint8_t brightness;			// Последняя заданная яркость, 0..255.
+		uint8_t last;				// Последняя ненулевая яркость, для включения переключением.
+	};
+	
+	trip_t trips[CFG_PortCount] = {};
+	dimmer_t dimmer = { 0, 0, 0, 0xFF };
+	trip_event_t trip_event = nullptr;
+	diag_state_t diags[CFG_PortCount] = {};
+	diag_event_t diag_event = nullptr;
+	pattern_state_t patterns[CFG_PortCount] = {};
+	volatile uint32_t trip_latency_max = 0;		// Худшее время от входа в прерывание до отключения порта, такты.
+	
+	// Программное отключение PowerOut. Вывод диммера в режиме AF, запись PowerOut в GPIO его не выключает:
+	// выход принудительно неактивен, как в ShortCircuitIRQ(), и защёлка держит его до SetOff().
 	void OnShortCircuit(uint8_t num, uint16_t current)
 	{
-
+		if(num == CFG_DimmerPort)
+		{
+			TIM1->CCMR1 = (TIM1->CCMR1 & ~TIM_CCMR1_OC1M) | TIM_CCMR1_OC1M_2;
+			dimmer.level = 0;
+			dimmer.target = 0;
+			
+			trips[num - 1].peak = current;
+			trips[num - 1].latched = true;
+		}
+		
+		if(trip_event != nullptr)
+		{
+			trip_event(num, current);
+		}
+		
+		return;
+	}
+	
+	inline void SetTripEvent(trip_event_t event)
+	{
+		trip_event = event;
+		
+		return;
+	}
+	
+	inline void SetDiagEvent(diag_event_t event)
+	{
+		diag_event = event;
+		
+		return;
+	}
+	
+	// Одно инжектированное измерение канала ADC2, ~3 мкс. Регулярное сканирование продолжается после него.
+	inline uint16_t SampleInjected(uint32_t channel)
+	{
+		ADC2->JSQR = channel << ADC_JSQR_JSQ4_Pos;
+		ADC2->SR = ~ADC_SR_JEOC;
+		ADC2->CR2 |= ADC_CR2_JSWSTART;
+		while( (ADC2->SR & ADC_SR_JEOC) == 0 ){}
+		
+		return ADC2->JDR1;
+	}
+	
+	// Вызывается из HAL_ADC_LevelOutOfWindowCallback(): ток одного из портов выше CFG_TripCurrent.
+	// У ADC2 нет DMA, и регулярный канал, на котором сработал сторож, неизвестен: токи всех портов
+	// перемеряются инжектированным каналом, порты выше порога отключаются прямо в прерывании.
+	// Порог подтверждается вторым измерением: одно искажённое совпадением с ADC1 (см. Setup()) порт не отключит.
+	inline void ShortCircuitIRQ(uint32_t stamp)
+	{
+		for(uint8_t i = 0; i < CFG_PortCount; ++i)
+		{
+			uint16_t adc = SampleInjected(CFG_Ports[i].channel);
+			if(adc < CurrentToADC(CFG_TripCurrent)) continue;
+			
+			uint16_t confirm = SampleInjected(CFG_Ports[i].channel);
+			if(confirm < CurrentToADC(CFG_TripCurrent)) continue;
+			if(confirm < adc) adc = confirm;
+			
+			CFG_Ports[i].port->BSRR = (uint32_t)CFG_Ports[i].pin << 16;
+			if(i + 1 == CFG_DimmerPort)
+			{
+				// Вывод диммера принадлежит таймеру: выход принудительно неактивен (OC1M = 100).
+				TIM1->CCMR1 = (TIM1->CCMR1 & ~TIM_CCMR1_OC1M) | TIM_CCMR1_OC1M_2;
+				dimmer.level = 0;
+				dimmer.target = 0;
+			}
+			
+			uint32_t latency = DWT->CYCCNT - stamp;
+			if(latency > trip_latency_max) trip_latency_max = latency;
+			
+			uint16_t current = ADCToCurrent(adc);
+			if(trips[i].latched == false || current > trips[i].peak) trips[i].peak = current;
+			trips[i].latched = true;
+			trips[i].pending = true;
+		}
+		
+		return;
+	}
+	
+	// Вызывается из HAL_TIM_PeriodElapsedCallback() TIM1, 1 кГц: шаг плавного изменения яркости.
+	inline void FadeIRQ()
+	{
+		uint32_t level = dimmer.level;
+		uint32_t target = dimmer.target;
+		if(level == target) return;
+		
+		static constexpr uint32_t step_up = (1000 << 8) / CFG_FadeInTime;
+		static constexpr uint32_t step_down = (1000 << 8) / CFG_FadeOutTime;
+		if(level < target)
+		{
+			level = (level + step_up > target) ? target : level + step_up;
+		}
+		else
+		{
+			level = (level < target + step_down) ? target : level - step_down;
+		}
+		dimmer.level = level;
+		
+		__HAL_TIM_SET_COMPARE(&htim1, TIM_CHANNEL_1, level >> 8);
+		
+		return;
+	}
+	
+	// Вызывается из HAL_TIM_PeriodElapsedCallback() TIM4, 1 кГц: шаг шаблонов выходов.
+	// Порт переключается через BSRR в обход PowerOut, аппаратная защита ADC2 при этом продолжает работать.
+	void PatternIRQ()
+	{
+		for(uint8_t i = 0; i < CFG_PortCount; ++i)
+		{
+			pattern_state_t &pattern = patterns[i];
+			const uint8_t *program = pattern.program;
+			if(program == nullptr) continue;
+			
+			const port_t &port = CFG_Ports[i];
+			if(trips[i].latched == true)
+			{
+				pattern.program = nullptr;
+				continue;
+			}
+			if(pattern.delay > 0 && --pattern.delay > 0) continue;
+			
+			// Ограничение кол-ва команд за тик защищает от шаблона без пауз внутри повтора.
+			for(uint8_t steps = 0; steps < 16 && pattern.delay == 0; ++steps)
+			{
+				uint8_t op = program[pattern.pc];
+				uint8_t arg = program[pattern.pc + 1];
+				pattern.pc += 2;
+				
+				switch(op)
+				{
+					case OP_ON: { port.port->BSRR = port.pin; break; }
+					case OP_OFF: { port.port->BSRR = (uint32_t)port.pin << 16; break; }
+					case OP_WAIT: { pattern.delay = arg * 10; break; }
+					case OP_REPEAT:
+					{
+						pattern.loop_pc = pattern.pc;
+						pattern.loop_count = arg;
+						
+						break;
+					}
+					case OP_NEXT:
+					{
+						if(pattern.loop_count == 0 || --pattern.loop_count > 0) pattern.pc = pattern.loop_pc;
+						
+						break;
+					}
+					default:
+					{
+						port.port->BSRR = (uint32_t)port.pin << 16;
+						pattern.program = nullptr;
+						steps = 16;
+						
+						break;
+					}
+				}
+			}
+		}
+		
+		return;
+	}
+	
+	inline bool IsPatternRunning(uint8_t num)
+	{
+		return patterns[num - 1].program != nullptr;
+	}
+	
+	// Останавливает шаблон и выключает выход: PowerOut считает порт выключенным и сам вывод не сбросит.
+	inline void StopPattern(uint8_t num)
+	{
+		if(patterns[num - 1].program == nullptr) return;
+		
+		// Сначала шаблон, затем вывод: PatternIRQ() между ними уже не включит порт.
+		patterns[num - 1].program = nullptr;
+		CFG_Ports[num - 1].port->BSRR = (uint32_t)CFG_Ports[num - 1].pin << 16;
+		
+		return;
+	}
+	
+	// Запускает шаблон на порту вместо текущего состояния. Диммер шаблоны не исполняет: его вывод у TIM1.
+	// Шаблон пишет в вывод мимо PowerOut, поэтому программное отключение по port_t.limit на нём не работает.
+	// Порт защищает аппаратное отключение по CFG_TripCurrent (сторож ADC2, ShortCircuitIRQ()), после него
+	// PatternIRQ() шаблон останавливает.
+	bool RunPattern(uint8_t num, uint8_t id)
+	{
+		if(num == 0 || num > CFG_PortCount || num == CFG_DimmerPort || id >= PATTERN_COUNT) return false;
+		if(id != PATTERN_NONE && trips[num - 1].latched == true) return false;
+		
+		pattern_state_t &pattern = patterns[num - 1];
+		StopPattern(num);
+		PowerBudget::Cancel(PowerBudget::LOAD_PORT1 + num - 1);
+		outObj.SetOff(num);
+		if(id == PATTERN_NONE) return true;
+		
+		// Поля кроме program не volatile: пишутся при запрещённых прерываниях, PatternIRQ() видит шаблон целиком.
+		__disable_irq();
+		pattern.pc = 0;
+		pattern.loop_pc = 0;
+		pattern.loop_count = 0;
+		pattern.delay = 0;
+		pattern.program = CFG_Patterns[id];
+		__enable_irq();
+		
+		return true;
+	}
+	
+	// Яркость диммера 0..255, скважность по квадратичной гамме. Плавное изменение снижает и пусковой ток лампы,
+	// поэтому диммер не проходит через PowerBudget.
+	bool SetBrightness(uint8_t brightness)
+	{
+		if(brightness > 0 && trips[CFG_DimmerPort - 1].latched == true) return false;
+		
+		dimmer.brightness = brightness;
+		if(brightness > 0) dimmer.last = brightness;
+		dimmer.target = (((uint32_t)brightness * brightness * 1000) / (255 * 255)) << 8;
+		
+		return true;
+	}
+	
+	inline uint8_t GetBrightness()
+	{
+		return dimmer.brightness;
+	}
+	
+	// Включение порта через PowerBudget: при занятом бюджете пусковых токов порт включается на несколько мс позже.
+	PowerBudget::result_t SetOn(uint8_t num, uint16_t blink_on = 0, uint16_t blink_off = 0)
+	{
+		if(num == CFG_DimmerPort) return (SetBrightness(dimmer.last) == true) ? PowerBudget::RESULT_STARTED : PowerBudget::RESULT_FAILED;
+		if(trips[num - 1].latched == true) return PowerBudget::RESULT_FAILED;
+		StopPattern(num);
+		
+		return PowerBudget::Request(PowerBudget::LOAD_PORT1 + num - 1, [](uint8_t load, uint16_t blink_on, uint16_t blink_off) -> bool
+		{
+			return outObj.SetOn(load - PowerBudget::LOAD_PORT1 + 1, blink_on, blink_off);
+		}, blink_on, blink_off);
+	}
+	
+	// Снимает и защёлку защиты.
+	bool SetOff(uint8_t num)
+	{
+		PowerBudget::Cancel(PowerBudget::LOAD_PORT1 + num - 1);
+		if(num == CFG_DimmerPort)
+		{
+			SetBrightness(0);
+			if(trips[num - 1].latched == true)
+			{
+				// Возврат выхода диммера в ШИМ (OC1M = 110) после отключения защитой.
+				TIM1->CCMR1 = (TIM1->CCMR1 & ~TIM_CCMR1_OC1M) | TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1;
+				trips[num - 1].latched = false;
+			}
+			
+			return true;
+		}
+		trips[num - 1].latched = false;
+		StopPattern(num);
+		
+		return outObj.SetOff(num);
+	}
+	
+	// Отложенный пуск и исполняемый шаблон считаются включённым состоянием.
+	bool GetState(uint8_t num)
+	{
+		if(num == CFG_DimmerPort) return dimmer.target > 0;
+		
+		return outObj.GetState(num) || PowerBudget::IsPending(PowerBudget::LOAD_PORT1 + num - 1) || IsPatternRunning(num);
+	}
+	
+	bool SetToggle(uint8_t num)
+	{
+		return (GetState(num) == true || trips[num - 1].latched == true) ? SetOff(num) : (SetOn(num) != PowerBudget::RESULT_FAILED);
+	}
+	
+	// Ток включённого порта по окну CFG_Ports, через CFG_DiagDelay после включения. Сообщается результат,
+	// подтверждённый CFG_DiagConfirm проверками подряд, один раз на каждое изменение.
+	void Diagnose(uint8_t num, uint32_t current_time)
+	{
+		const port_t &port = CFG_Ports[num - 1];
+		diag_state_t &diag = diags[num - 1];
+		if(port.open == 0) return;
+		
+		bool on = GetState(num);
+		if(on != diag.on)
+		{
+			diag.on = on;
+			diag.on_time = current_time;
+			diag.hits = 0;
+			diag.reported = DIAG_OK;
+		}
+		if(on == false || current_time - diag.on_time < CFG_DiagDelay) return;
+		
+		// Ток диммера зависит от яркости: проверяется только полная яркость после окончания плавного включения.
+		if(num == CFG_DimmerPort && (dimmer.target != (1000 << 8) || dimmer.level != dimmer.target))
+		{
+			diag.hits = 0;
+			return;
+		}
+		
+		// Шаблон переключает порт чаще проверок, ток в паузах не говорит о нагрузке.
+		if(IsPatternRunning(num) == true)
+		{
+			diag.hits = 0;
+			return;
+		}
+		
+		uint16_t current = outObj.GetCurrent(num);
+		uint8_t result = DIAG_OK;
+		if(current < port.open) result = DIAG_OPEN;
+		else if(current < port.min) result = DIAG_DEGRADED;
+		else if(current > port.max) result = DIAG_OVERLOAD;
+		
+		diag.hits = (result == diag.last && diag.hits < 0xFF) ? diag.hits + 1 : 1;
+		diag.last = result;
+		if(diag.hits < CFG_DiagConfirm || result == diag.reported) return;
+		
+		diag.reported = result;
+		if(result != DIAG_OK && diag_event != nullptr)
+		{
+			DEBUG_LOG_TOPIC("POUT", "port %d load diag %d, %d mA\n", num, result, current);
+			diag_event(num, result);
+		}
+		
+		return;
 	}
 	
 	inline void Setup()
 	{
-		outObj.AddPort( {GPIOA, GPIO_PIN_8}, {GPIOA, ADC_CHANNEL_6}, 5000 );
-		outObj.AddPort( {GPIOB, GPIO_PIN_15}, {GPIOA, ADC_CHANNEL_5}, 5000 );
-		outObj.AddPort( {GPIOB, GPIO_PIN_14}, {GPIOA, ADC_CHANNEL_4}, 5000 );
-		outObj.AddPort( {GPIOB, GPIO_PIN_13}, {GPIOA, ADC_CHANNEL_3}, 5000 );
-		outObj.AddPort( {GPIOB, GPIO_PIN_12}, {GPIOA, ADC_CHANNEL_2}, 5000 );
-		outObj.AddPort( {GPIOB, GPIO_PIN_2}, {GPIOA, ADC_CHANNEL_1}, 10000 );
+		for(const port_t &port : CFG_Ports)
+		{
+			outObj.AddPort( {port.port, port.pin}, {GPIOA, port.channel}, port.limit );
+		}
 		outObj.Init();
+		
+		// Вывод диммера переходит от PowerOut к TIM1_CH1N, ток и защита остаются общими.
+		GPIO_InitTypeDef dimmer_pin = { CFG_Ports[CFG_DimmerPort - 1].pin, GPIO_MODE_AF_PP, GPIO_NOPULL, GPIO_SPEED_FREQ_LOW };
+		HAL_GPIO_Init(CFG_Ports[CFG_DimmerPort - 1].port, &dimmer_pin);
+		HAL_TIMEx_PWMN_Start(&htim1, TIM_CHANNEL_1);
+		HAL_TIM_Base_Start_IT(&htim1);
+		HAL_TIM_Base_Start_IT(&htim4);
+		
+		// ADC2 непрерывно сканирует токи портов, аналоговый сторож следит за всеми каналами.
+		// Каналы те же, что опрашивает PowerOut через ADC1, а RM0008 запрещает одновременную выборку
+		// одного канала обоими АЦП. Сдвинуть сканирование нельзя: ADC1 опрашивается программно в
+		// произвольный момент. Совпадение выборок искажает одно измерение каждого АЦП, чем это кончается:
+		// - ADC1: одно значение тока PowerOut, диагностике нужно CFG_DiagConfirm проверок подряд, от КЗ защищает ADC2;
+		// - ADC2 регулярный канал занижен: сторож сработает на следующем проходе сканирования (~20 мкс);
+		// - ADC2 регулярный канал завышен: ShortCircuitIRQ() только перемеряет порты инжектированным каналом;
+		// - ADC2 инжектированный канал: отключение требует двух измерений выше порога подряд.
+		ADC_ChannelConfTypeDef channel_config = { ADC_CHANNEL_0, ADC_REGULAR_RANK_1, ADC_SAMPLETIME_13CYCLES_5 };
+		for(uint8_t i = 0; i < CFG_PortCount; ++i)
+		{
+			channel_config.Channel = CFG_Ports[i].channel;
+			channel_config.Rank = ADC_REGULAR_RANK_1 + i;
+			HAL_ADC_ConfigChannel(&hadc2, &channel_config);
+		}
+		
+		ADC_AnalogWDGConfTypeDef awd_config = {};
+		awd_config.WatchdogMode = ADC_ANALOGWATCHDOG_ALL_REG;
+		awd_config.HighThreshold = CurrentToADC(CFG_TripCurrent);
+		awd_config.LowThreshold = 0;
+		awd_config.ITMode = ENABLE;
+		HAL_ADC_AnalogWDGConfig(&hadc2, &awd_config);
+		
+		// Инжектированная группа запускается программно из ShortCircuitIRQ(). Время выборки задаётся
+		// на канал, поэтому оно уже настроено вместе с регулярной группой.
+		ADC2->CR2 |= ADC_CR2_JEXTSEL | ADC_CR2_JEXTTRIG;
+		
+		HAL_ADCEx_Calibration_Start(&hadc2);
+		HAL_ADC_Start(&hadc2);
 
 		//outObj.On(4);
 		//outObj.On(6);
@@ -44,6 +529,34 @@ namespace Outputs
 	{
 		outObj.Processing(current_time);
 		
+		// Порты, отключённые защитой: состояние PowerOut догоняет выход, ошибка уходит в trip_event.
+		for(uint8_t i = 0; i < CFG_PortCount; ++i)
+		{
+			if(trips[i].pending == false) continue;
+			trips[i].pending = false;
+			
+			PowerBudget::Cancel(PowerBudget::LOAD_PORT1 + i);
+			StopPattern(i + 1);
+			outObj.SetOff(i + 1);
+			
+			DEBUG_LOG_TOPIC("POUT", "port %d short circuit trip, peak %d mA, latency max %lu cycles\n", i + 1, trips[i].peak, trip_latency_max);
+			if(trip_event != nullptr)
+			{
+				trip_event(i + 1, trips[i].peak);
+			}
+		}
+		
+		static uint32_t diag_time = 0;
+		if(current_time - diag_time >= CFG_DiagInterval)
+		{
+			diag_time = current_time;
+			
+			for(uint8_t num = 1; num <= CFG_PortCount; ++num)
+			{
+				Diagnose(num, current_time);
+			}
+		}
+		
 		static uint32_t last_time = 0;
 		if(current_time - last_time > 250)
 		{
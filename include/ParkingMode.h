@@ -0,0 +1,236 @@
+#pragma once
+
+/*
+	Режим стоянки: STOP с пробуждением по активности на CAN RX.
+	Вход по команде ParkingMode или после CFG_IdleTime без команд, когда все нагрузки выключены.
+	В STOP тактирование остановлено и bxCAN кадры не принимает: первый кадр на шине только будит
+	плату через EXTI11 (PA11 = CAN_RX) и теряется, команду исполняет её повтор.
+*/
+
+#include <CANLibrary.h>
+
+extern ADC_HandleTypeDef hadc2;
+extern CAN_HandleTypeDef hcan;
+extern TIM_HandleTypeDef htim1;
+extern TIM_HandleTypeDef htim4;
+
+void SystemClock_Config(void);
+
+namespace Parking
+{
+	static constexpr uint32_t CFG_IdleTime = 600000;			// Время без команд и включённых нагрузок до входа в STOP, мс. 0 - только по команде.
+	static constexpr can_object_id_t CFG_IdFirst = 0x0180;		// Диапазон ID объектов блока: кадры в него, кроме request, считаются командами.
+	static constexpr can_object_id_t CFG_IdLast = 0x01FF;
+	static constexpr uint32_t CFG_WakeLine = GPIO_PIN_11;		// Линия EXTI вывода CAN_RX.
+
+	struct stats_t
+	{
+		uint16_t count;				// Кол-во выходов из STOP.
+		uint32_t wake_time;			// От выхода из WFI до восстановления тактирования и периферии, мкс.
+		uint32_t wake_time_max;
+		uint32_t command_time;		// От пробуждения до первой команды, мс.
+		uint32_t command_time_max;
+	};
+
+	volatile uint32_t last_command = 0;		// Время последней команды блоку.
+	volatile bool awaiting_command = false;	// После пробуждения команда ещё не пришла.
+	uint32_t last_busy = 0;					// Время, когда нагрузки были включены в последний раз.
+	uint32_t wake_tick = 0;
+	bool requested = false;					// Вход по команде, ждёт выключения нагрузок.
+	uint32_t request_time = 0;
+	bool command_report = false;
+	stats_t stats = {};
+
+
+	// Вызывается из прерывания RX FIFO.
+	inline void OnRxFrame(can_object_id_t id, uint8_t function)
+	{
+		if(id < CFG_IdFirst || id > CFG_IdLast || function == CAN_FUNC_REQUEST_IN) return;
+
+		uint32_t time = HAL_GetTick();
+		last_command = time;
+		if(awaiting_command == true)
+		{
+			awaiting_command = false;
+			stats.command_time = time - wake_tick;
+			if(stats.command_time > stats.command_time_max) stats.command_time_max = stats.command_time;
+			command_report = true;
+		}
+
+		return;
+	}
+
+	// Включённые порты, ход и реверс актуаторов, неснятая авария драйвера, отложенные пуски и неотправленные кадры.
+	bool IsBusy()
+	{
+		for(uint8_t num = 1; num <= Outputs::CFG_PortCount; ++num)
+		{
+			if(Outputs::GetState(num) == true) return true;
+		}
+		if(Outputs::dimmer.level > 0) return true;
+
+		if(EnergyStats::IsIdle() == false) return true;
+		for(TrunkHood::actuator_t &actuator : TrunkHood::actuators)
+		{
+			if(actuator.driver.IsReversing() == true || actuator.driver.IsFault() == true) return true;
+			if(TrunkHood::IsHoming(actuator) == true || PowerBudget::IsPending(actuator.config.load) == true) return true;
+		}
+
+		return HAL_CAN_GetTxMailboxesFreeLevel(&hcan) < 3;
+	}
+
+	// Вход по команде: порты выключаются, STOP - после остановки актуаторов и отправки ответа.
+	// Новая команда блоку до входа отменяет запрос.
+	void Request(bool enter)
+	{
+		requested = enter;
+		request_time = HAL_GetTick();
+		if(enter == false) return;
+
+		for(uint8_t num = 1; num <= Outputs::CFG_PortCount; ++num)
+		{
+			Outputs::SetOff(num);
+		}
+
+		return;
+	}
+
+	inline bool IsRequested()
+	{
+		return requested;
+	}
+
+	// Возврат периферии после STOP или отменённого входа в него.
+	void Resume()
+	{
+		HAL_ResumeTick();
+
+		EXTI->IMR &= ~CFG_WakeLine;
+		EXTI->FTSR &= ~CFG_WakeLine;
+
+		HAL_TIMEx_PWMN_Start(&htim1, TIM_CHANNEL_1);
+		HAL_TIM_Base_Start_IT(&htim1);
+		HAL_TIM_Base_Start_IT(&htim4);
+		HAL_ADC_Start(&hadc2);
+
+		return;
+	}
+
+	void Sleep()
+	{
+		DEBUG_LOG_TOPIC("PARK", "enter STOP\n");
+
+		// Кадр, принятый после этой точки, отменяет вход: в STOP он остался бы необработанным.
+		uint32_t command = last_command;
+		uint32_t rx = EnergyStats::last_rx;
+
+		// Счётчики энергии сохраняются: питание на стоянке может пропасть.
+		if(EnergyStats::CFG_SnapshotInterval > 0)
+		{
+			EnergyStats::storage.Save(EnergyStats::data);
+		}
+
+		// EN = 0: мосты DRV8874 в сне.
+		for(TrunkHood::actuator_t &actuator : TrunkHood::actuators)
+		{
+			actuator.driver.ActionOff();
+		}
+		for(uint8_t led = Leds::LED_RED; led <= Leds::LED_BLUE; ++led)
+		{
+			Leds::obj.SetOff(led);
+		}
+
+		HAL_TIM_Base_Stop_IT(&htim4);
+		HAL_TIM_Base_Stop_IT(&htim1);
+		HAL_TIMEx_PWMN_Stop(&htim1, TIM_CHANNEL_1);
+		HAL_ADC_Stop(&hadc2);
+		HAL_SuspendTick();
+
+		// Вывод остаётся входом CAN_RX, EXTI11 только подключается к порту A: доминантный бит - спад.
+		AFIO->EXTICR[2] &= ~AFIO_EXTICR3_EXTI11;
+		EXTI->FTSR |= CFG_WakeLine;
+		EXTI->PR = CFG_WakeLine;
+		EXTI->IMR |= CFG_WakeLine;
+
+		// Последняя проверка при запрещённых прерываниях: после неё кадр уже только будит ядро из WFI,
+		// прерывание EXTI или RX FIFO выполняется после __enable_irq().
+		__disable_irq();
+		if(last_command != command || EnergyStats::last_rx != rx || HAL_CAN_GetRxFifoFillLevel(&hcan, CAN_RX_FIFO0) > 0)
+		{
+			__enable_irq();
+			Resume();
+
+			// Запрос по команде остаётся: после паузы на шине вход повторяется, новую команду снимает Loop().
+			DEBUG_LOG_TOPIC("PARK", "STOP cancelled: frame received\n");
+
+			return;
+		}
+
+		// Метка снимается до __enable_irq(): ядро будит любая линия EXTI (CAN_RX, nFAULT), обработчики
+		// ещё не выполнялись, ядро работает от HSI.
+		HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+		uint32_t wake_stamp = DWT->CYCCNT;
+		__enable_irq();
+
+		// До переключения на PLL в SystemClock_Config() ядро работает от HSI, время запуска HSE и PLL
+		// считается по HSI целиком, оценка сверху.
+		SystemClock_Config();
+		uint32_t pll_stamp = DWT->CYCCNT;
+		Resume();
+
+		uint32_t ready_stamp = DWT->CYCCNT;
+		uint32_t wake_time = (pll_stamp - wake_stamp) / (HSI_VALUE / 1000000) + (ready_stamp - pll_stamp) / (SystemCoreClock / 1000000);
+
+		++stats.count;
+		stats.wake_time = wake_time;
+		if(wake_time > stats.wake_time_max) stats.wake_time_max = wake_time;
+
+		requested = false;
+		wake_tick = HAL_GetTick();
+		last_command = wake_tick;
+		last_busy = wake_tick;
+		awaiting_command = true;
+
+		DEBUG_LOG_TOPIC("PARK", "wake up in %lu us (max %lu us)\n", stats.wake_time, stats.wake_time_max);
+
+		return;
+	}
+
+	inline void Setup()
+	{
+		last_command = HAL_GetTick();
+		last_busy = last_command;
+
+		return;
+	}
+
+	inline void Loop(uint32_t &current_time)
+	{
+		if(command_report == true)
+		{
+			command_report = false;
+			DEBUG_LOG_TOPIC("PARK", "first command %lu ms after wake up (max %lu ms)\n", stats.command_time, stats.command_time_max);
+		}
+
+		// last_command меняется в прерывании и может быть новее current_time.
+		int32_t command_age = current_time - last_command;
+		if(requested == true && (int32_t)(last_command - request_time) > 0)
+		{
+			requested = false;
+		}
+
+		if(IsBusy() == true)
+		{
+			last_busy = current_time;
+		}
+		// Sleep() сохраняет счётчики во flash: вход откладывается до паузы на шине.
+		else if( (requested == true || (CFG_IdleTime > 0 && command_age >= (int32_t)CFG_IdleTime && current_time - last_busy >= CFG_IdleTime)) && EnergyStats::IsBusQuiet(current_time) == true )
+		{
+			Sleep();
+		}
+
+		current_time = HAL_GetTick();
+
+		return;
+	}
+}
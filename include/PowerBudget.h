@@ -0,0 +1,206 @@
+#pragma once
+
+/*
+	Координатор пусков нагрузок.
+	Каждый пуск актуатора или порта PowerOut проходит через Request(): нагрузка занимает свой пусковой ток
+	на время пуска, и если сумма с уже идущими пусками превышает CFG_PeakBudget, пуск откладывается
+	на несколько мс до освобождения бюджета. Так пусковые токи не складываются и питание не проседает.
+*/
+
+namespace PowerBudget
+{
+	static constexpr uint16_t CFG_PeakBudget = 10000;		// Допустимый суммарный пусковой ток всех нагрузок, мА.
+	static constexpr uint16_t CFG_MaxDelay = 20;			// Предельная задержка пуска, мс. Дальше пуск выполняется без учёта бюджета.
+	static constexpr uint32_t CFG_ReportInterval = 5000;	// Период вывода статистики отложенных пусков, мс.
+
+	enum load_id_t : uint8_t
+	{
+		LOAD_HOOD, LOAD_TRUNK,
+		LOAD_PORT1, LOAD_PORT2, LOAD_PORT3, LOAD_PORT4, LOAD_PORT5, LOAD_PORT6,
+		LOAD_COUNT
+	};
+
+	struct load_t
+	{
+		uint16_t inrush;		// Пусковой ток, мА.
+		uint16_t time;			// Длительность пуска, мс.
+	};
+
+	// Порядок совпадает с load_id_t.
+	static constexpr load_t CFG_Loads[] =
+	{
+		{ 1500, 100 },		// Капот: плавный разгон ограничивает пусковой ток, но растягивает пуск.
+		{ 1500, 100 },		// Багажник.
+		{ 3000, 10 },		// Порт 1: вторичная электроника, заряд входных конденсаторов.
+		{ 4000, 20 },		// Порт 2: замок левой двери.
+		{ 4000, 20 },		// Порт 3: замок правой двери.
+		{ 3000, 10 },		// Порт 4: свет в салоне.
+		{ 1500, 10 },		// Порт 5: камера заднего вида.
+		{ 6000, 30 },		// Порт 6: клаксон.
+	};
+	static_assert(sizeof(CFG_Loads) / sizeof(CFG_Loads[0]) == LOAD_COUNT, "Every load needs an inrush entry");
+
+	// Функция пуска нагрузки, параметры передаются без изменений из Request().
+	using start_t = bool (*)(uint8_t load, uint16_t param1, uint16_t param2);
+
+	enum result_t : uint8_t
+	{
+		RESULT_FAILED,			// Функция пуска вернула false.
+		RESULT_STARTED,			// Нагрузка запущена.
+		RESULT_DEFERRED,		// Пуск отложен, результат придёт в done_event.
+	};
+
+	// Результат отложенного пуска: RESULT_STARTED или RESULT_FAILED, forced - пуск сверх бюджета по CFG_MaxDelay.
+	using done_event_t = void (*)(uint8_t load, result_t result, bool forced);
+
+	struct request_t
+	{
+		start_t start;
+		uint16_t param1;
+		uint16_t param2;
+		uint32_t time;			// Время запроса.
+		bool pending;
+	};
+
+	struct stats_t
+	{
+		uint16_t queued;		// Кол-во отложенных пусков.
+		uint16_t forced;		// Кол-во пусков, выполненных по CFG_MaxDelay сверх бюджета.
+		uint16_t delay_max;		// Наибольшая задержка пуска, мс.
+		uint16_t failed;		// Кол-во отложенных пусков, функция пуска которых вернула false.
+	};
+
+	request_t requests[LOAD_COUNT] = {};
+	uint32_t busy_until[LOAD_COUNT] = {};		// Время окончания пуска нагрузки.
+	stats_t stats = {};
+	done_event_t done_event = nullptr;
+
+
+	// Пусковой ток, занятый другими нагрузками в момент time.
+	uint16_t GetReserved(uint8_t load, uint32_t time)
+	{
+		uint16_t result = 0;
+		for(uint8_t i = 0; i < LOAD_COUNT; ++i)
+		{
+			if(i == load) continue;
+			if( (int32_t)(busy_until[i] - time) > 0 ) result += CFG_Loads[i].inrush;
+		}
+
+		return result;
+	}
+
+	inline bool IsFits(uint8_t load, uint32_t time)
+	{
+		uint16_t reserved = GetReserved(load, time);
+
+		// Нагрузка, которая одна больше бюджета, запускается, когда других пусков нет.
+		return reserved == 0 || reserved + CFG_Loads[load].inrush <= CFG_PeakBudget;
+	}
+
+	bool Run(uint8_t load, const request_t &request, uint32_t time)
+	{
+		busy_until[load] = time + CFG_Loads[load].time;
+
+		return request.start(load, request.param1, request.param2);
+	}
+
+	inline void SetDoneEvent(done_event_t event)
+	{
+		done_event = event;
+
+		return;
+	}
+
+	// Снимает отложенный пуск, например при выключении нагрузки до её пуска. done_event не вызывается.
+	inline void Cancel(uint8_t load)
+	{
+		requests[load].pending = false;
+
+		return;
+	}
+
+	inline bool IsPending(uint8_t load)
+	{
+		return requests[load].pending;
+	}
+
+	// Пускает нагрузку сразу или откладывает пуск. Новый запрос заменяет отложенный запрос той же нагрузки.
+	// Отложенный пуск сообщает результат через done_event.
+	result_t Request(uint8_t load, start_t start, uint16_t param1 = 0, uint16_t param2 = 0)
+	{
+		uint32_t time = HAL_GetTick();
+		request_t &request = requests[load];
+
+		request.start = start;
+		request.param1 = param1;
+		request.param2 = param2;
+
+		if(request.pending == false)
+		{
+			request.time = time;
+
+			if(IsFits(load, time) == true)
+			{
+				return (Run(load, request, time) == true) ? RESULT_STARTED : RESULT_FAILED;
+			}
+
+			request.pending = true;
+			++stats.queued;
+		}
+
+		return RESULT_DEFERRED;
+	}
+
+	inline void Loop(uint32_t &current_time)
+	{
+		// Отложенные пуски выполняются по очереди запросов.
+		while(true)
+		{
+			uint8_t load = LOAD_COUNT;
+			for(uint8_t i = 0; i < LOAD_COUNT; ++i)
+			{
+				if(requests[i].pending == false) continue;
+				if(load == LOAD_COUNT || (int32_t)(requests[i].time - requests[load].time) < 0) load = i;
+			}
+			if(load == LOAD_COUNT) break;
+
+			request_t &request = requests[load];
+			uint32_t delay = current_time - request.time;
+			bool forced = false;
+			if(IsFits(load, current_time) == false)
+			{
+				if(delay < CFG_MaxDelay) break;
+
+				++stats.forced;
+				forced = true;
+			}
+
+			if(delay > stats.delay_max) stats.delay_max = delay;
+			request.pending = false;
+			result_t result = (Run(load, request, current_time) == true) ? RESULT_STARTED : RESULT_FAILED;
+			if(result == RESULT_FAILED) ++stats.failed;
+
+			if(done_event != nullptr)
+			{
+				done_event(load, result, forced);
+			}
+		}
+
+		static uint32_t last_report = 0;
+		static uint16_t last_queued = 0;
+		if(current_time - last_report > CFG_ReportInterval)
+		{
+			last_report = current_time;
+
+			if(stats.queued != last_queued)
+			{
+				last_queued = stats.queued;
+				DEBUG_LOG_TOPIC("PWR", "queued starts: %d, forced: %d, failed: %d, max delay: %d ms\n", stats.queued, stats.forced, stats.failed, stats.delay_max);
+			}
+		}
+
+		current_time = HAL_GetTick();
+
+		return;
+	}
+}
@@ -1,17 +1,156 @@
 #pragma once
 
+#include <utility>
 #include  <DRV8874.h>
+#include <FlashStorage.h>
+
+extern TIM_HandleTypeDef htim2;
+extern TIM_HandleTypeDef htim3;
 
 namespace TrunkHood
 {
 	static constexpr uint32_t CFG_RefVoltage = 3324000;		// Опорное напряжение, микровольты.
 	static constexpr uint16_t CFG_LoadResistance = 2490;	// Сопротивление шунта, омы.
+	static constexpr uint16_t CFG_CurrentCeiling = (CFG_RefVoltage / CFG_LoadResistance) * 100 / 45;	// Предел измерения тока через IPROPI (450 мкА/А), мА.
 	static constexpr uint16_t CFG_IdleCurrent = 100;		// Ток, меньше которого считаем что нагрузки нет, мА.
-	static constexpr uint16_t CFG_FindDelay = 50;			// Время задержки при поиске положения, мс.
+	static constexpr uint16_t CFG_HomingBlanking = 50;		// Гашение пускового тока при поиске положения, отсчитывается после разгона, мс.
+	static constexpr uint8_t CFG_HomingSamples = 5;			// Кол-во отсчётов тока на одно направление при поиске положения.
+	static constexpr uint16_t CFG_HomingInterval = 10;		// Период отсчётов тока при поиске положения, мс.
+	static constexpr uint8_t CFG_HomingRetries = 3;			// Кол-во повторов поиска при неоднозначном результате.
+	static constexpr uint16_t CFG_HomingRetryDelay = 500;	// Пауза перед повтором поиска, мс.
+	static constexpr uint32_t CFG_StoragePage0 = 0x0800F800;	// Страницы flash для сохранения состояния актуаторов (две последние страницы 64 КБ, вне образа прошивки).
+	static constexpr uint32_t CFG_StoragePage1 = 0x0800FC00;
+	static constexpr uint16_t CFG_HomingBudget = 8000;		// Допустимый суммарный ток актуаторов, одновременно ищущих положение, мА.
 	static constexpr uint16_t CFG_StickIdleTime = 400;		// Время, через которое выключится актуатор, после пропадания флуда set команды.
+	static constexpr uint32_t CFG_TravelTime = 8000;		// Начальное время полного хода актуатора при номинальном токе, мс.
+	static constexpr uint16_t CFG_NominalCurrent = 1000;	// Ток актуатора при номинальной скорости, мА.
+	static constexpr uint16_t CFG_StallCurrent = 2500;		// Ток актуатора при остановке под нагрузкой, мА.
+	static constexpr uint16_t CFG_PositionTolerance = 20;	// Допуск достижения целевого положения, десятые доли процента.
+	static constexpr uint16_t CFG_PositionMax = 1000;		// Положение полностью открытого актуатора, десятые доли процента.
+	static constexpr uint8_t CFG_TargetNone = 0xFF;			// Целевое положение не задано.
+	static constexpr uint16_t CFG_AccelTime = 300;			// Время плавного разгона от 0 до 100% скважности, мс.
+	static constexpr uint16_t CFG_DecelTime = 200;			// Время плавного торможения от 100% скважности до 0, мс.
+	static constexpr uint8_t CFG_MinSpeed = 30;				// Скорость при минимальном отклонении джойстика, %.
+	
+	// Детектор упора и заклинивания: гашение пускового тока 150 мс, упор < 100 мА, заклинивание > 2,5 А,
+	// препятствие - рост на 800 мА над рабочим током со скоростью от 300 мА за 40 мс, подтверждение 3 отсчёта (15 мс).
+	static constexpr DRV8874::detector_t CFG_HoodDetector = { 150, CFG_IdleCurrent, CFG_StallCurrent, 800, 300, 3 };
+	static constexpr DRV8874::detector_t CFG_TrunkDetector = { 150, CFG_IdleCurrent, CFG_StallCurrent, 800, 300, 3 };
+	static_assert(CFG_StallCurrent > CFG_NominalCurrent && CFG_StallCurrent < CFG_CurrentCeiling, "CFG_StallCurrent must be measurable by IPROPI");
+	
+	// Защита: отключение при токе > 2,8 А после 100 мс пускового тока (выше IPROPI уже не измеряет); модель I²t -
+	// номинальный ток не греет, предел 1,575e6 (0,1 А)²*мс = ~3 с заклинивания при 2,5 А с холодного мотора.
+	// Больший ток читается как предел измерения (~2,96 А), с ним предел наступает за ~2 с. С 60% нагрева скорость
+	// снижается до 50% к пределу, после срабатывания запуск разрешается после остывания до 40% (~9,5 с).
+	static constexpr DRV8874::protection_t CFG_HoodProtection = { 2800, 100, CFG_NominalCurrent, 1575000, 60, 50, 40 };
+	static constexpr DRV8874::protection_t CFG_TrunkProtection = { 2800, 100, CFG_NominalCurrent, 1575000, 60, 50, 40 };
+	static_assert(CFG_HoodProtection.trip_current < CFG_CurrentCeiling && CFG_TrunkProtection.trip_current < CFG_CurrentCeiling, "Trip current must be measurable by IPROPI");
+	
+	// Реверс: торможение 50 мс, затем мост выключен 100 мс. Выше 50% скважности или 2 А мотор выбегает
+	// вместо торможения. Добавленная задержка реверса не больше 150 мс плюс период Loop().
+	static constexpr DRV8874::reversal_t CFG_Reversal = { 50, 100, 500, 2000 };
 
 
 	enum state_t : uint8_t { STATE_UNKNOWN, STATE_STOPPED, STATE_CLOSING, STATE_CLOSED, STATE_OPENING, STATE_OPENED };
+	static constexpr uint8_t STATE_COUNT = STATE_OPENED + 1;
+
+	// События автомата актуатора.
+	enum event_t : uint8_t
+	{
+		EVENT_TOGGLE,		// Команда toggle.
+		EVENT_OPEN,			// Джойстик или целевое положение: открывать.
+		EVENT_CLOSE,		// Джойстик или целевое положение: закрывать.
+		EVENT_STOP,			// Джойстик отпущен, пропал флуд set команды или достигнуто целевое положение.
+		EVENT_ENDSTOP,		// Ток пропал: достигнут концевой упор.
+		EVENT_FAULT,		// Драйвер остановил актуатор сам: заклинивание, препятствие, таймаут, nFAULT.
+		EVENT_COUNT
+	};
+
+	// Действия над драйвером при переходе.
+	enum action_t : uint8_t
+	{
+		ACTION_NONE,
+		ACTION_OPEN,		// Ход на открытие.
+		ACTION_CLOSE,		// Ход на закрытие.
+		ACTION_STOP,		// Плавная остановка.
+		ACTION_REVERSE,		// Ход в сторону, противоположную прерванной (после неизвестного состояния - на закрытие).
+		ACTION_ARRIVE,		// Выключение на упоре и калибровка положения.
+		ACTION_HALT,		// Драйвер уже остановлен, сбрасывается только цель.
+	};
+
+	struct transition_t
+	{
+		action_t action;
+		state_t next;
+	};
+
+	// Таблица переходов: состояние x событие -> действие, новое состояние.
+	static constexpr transition_t CFG_Transitions[STATE_COUNT][EVENT_COUNT] = 
+	{
+		//					TOGGLE								OPEN								CLOSE								STOP								ENDSTOP								FAULT
+		/* UNKNOWN */	{ { ACTION_STOP, STATE_STOPPED },		{ ACTION_OPEN, STATE_OPENING },		{ ACTION_CLOSE, STATE_CLOSING },	{ ACTION_NONE, STATE_UNKNOWN },		{ ACTION_NONE, STATE_UNKNOWN },		{ ACTION_HALT, STATE_UNKNOWN } },
+		/* STOPPED */	{ { ACTION_REVERSE, STATE_STOPPED },	{ ACTION_OPEN, STATE_OPENING },		{ ACTION_CLOSE, STATE_CLOSING },	{ ACTION_NONE, STATE_STOPPED },		{ ACTION_NONE, STATE_STOPPED },		{ ACTION_HALT, STATE_STOPPED } },
+		/* CLOSING */	{ { ACTION_STOP, STATE_STOPPED },		{ ACTION_OPEN, STATE_OPENING },		{ ACTION_NONE, STATE_CLOSING },		{ ACTION_STOP, STATE_STOPPED },		{ ACTION_ARRIVE, STATE_CLOSED },	{ ACTION_HALT, STATE_STOPPED } },
+		/* CLOSED */	{ { ACTION_OPEN, STATE_OPENING },		{ ACTION_OPEN, STATE_OPENING },		{ ACTION_CLOSE, STATE_CLOSING },	{ ACTION_NONE, STATE_CLOSED },		{ ACTION_NONE, STATE_CLOSED },		{ ACTION_HALT, STATE_CLOSED } },
+		/* OPENING */	{ { ACTION_STOP, STATE_STOPPED },		{ ACTION_NONE, STATE_OPENING },		{ ACTION_CLOSE, STATE_CLOSING },	{ ACTION_STOP, STATE_STOPPED },		{ ACTION_ARRIVE, STATE_OPENED },	{ ACTION_HALT, STATE_STOPPED } },
+		/* OPENED */	{ { ACTION_CLOSE, STATE_CLOSING },		{ ACTION_OPEN, STATE_OPENING },		{ ACTION_CLOSE, STATE_CLOSING },	{ ACTION_NONE, STATE_OPENED },		{ ACTION_NONE, STATE_OPENED },		{ ACTION_HALT, STATE_OPENED } },
+	};
+	
+	constexpr bool IsRunningState(state_t state)
+	{
+		return state == STATE_OPENING || state == STATE_CLOSING;
+	}
+	
+	// Действие согласовано с новым состоянием: ход - в OPENING/CLOSING, остановка - в STOPPED, упор - только из хода
+	// в своё крайнее положение, без действия состояние не меняется. Реверс переходит в OPEN/CLOSE того же состояния.
+	constexpr bool IsValidAction(state_t state, const transition_t &transition)
+	{
+		return (transition.action == ACTION_NONE && transition.next == state) ||
+			(transition.action == ACTION_OPEN && transition.next == STATE_OPENING) ||
+			(transition.action == ACTION_CLOSE && transition.next == STATE_CLOSING) ||
+			(transition.action == ACTION_STOP && transition.next == STATE_STOPPED) ||
+			(transition.action == ACTION_REVERSE && transition.next == state && CFG_Transitions[state][EVENT_OPEN].action == ACTION_OPEN && CFG_Transitions[state][EVENT_CLOSE].action == ACTION_CLOSE) ||
+			(transition.action == ACTION_ARRIVE && ( (state == STATE_CLOSING && transition.next == STATE_CLOSED) || (state == STATE_OPENING && transition.next == STATE_OPENED) )) ||
+			(transition.action == ACTION_HALT && IsRunningState(transition.next) == false);
+	}
+	
+	// Событие приводит в ожидаемое состояние: OPEN/CLOSE - ход в свою сторону, STOP и FAULT - не ход,
+	// FAULT только сбрасывает цель, ENDSTOP во время хода - упор, иначе игнорируется.
+	constexpr bool IsValidEvent(state_t state, event_t event, const transition_t &transition)
+	{
+		return (event == EVENT_OPEN) ? transition.next == STATE_OPENING :
+			(event == EVENT_CLOSE) ? transition.next == STATE_CLOSING :
+			(event == EVENT_STOP) ? IsRunningState(transition.next) == false :
+			(event == EVENT_ENDSTOP) ? transition.action == (IsRunningState(state) ? ACTION_ARRIVE : ACTION_NONE) :
+			(event == EVENT_FAULT) ? transition.action == ACTION_HALT && IsRunningState(transition.next) == false :
+			true;
+	}
+	
+	// Проверка таблицы при сборке: каждая клетка состояние x событие.
+	constexpr bool IsValidTransition(uint8_t state = 0, uint8_t event = 0)
+	{
+		return state == STATE_COUNT ||
+			( IsValidAction((state_t)state, CFG_Transitions[state][event]) && IsValidEvent((state_t)state, (event_t)event, CFG_Transitions[state][event]) &&
+			IsValidTransition((event + 1 == EVENT_COUNT) ? state + 1 : state, (event + 1 == EVENT_COUNT) ? 0 : event + 1) );
+	}
+	static_assert(IsValidTransition(), "Invalid CFG_Transitions cell");
+
+	// Аппаратная конфигурация актуатора.
+	struct actuator_config_t
+	{
+		DRV8874::pin_t in1;
+		DRV8874::pin_t in2;
+		DRV8874::pin_t en;
+		DRV8874::pin_t fault;
+		DRV8874::pin_t current;
+		TIM_HandleTypeDef *htim;	// Таймер ШИМ входов IN1/IN2, nullptr - без ШИМ.
+		uint32_t channel_in1;
+		uint32_t channel_in2;
+		DRV8874::detector_t detector;
+		DRV8874::protection_t protection;
+		uint32_t timeout;			// Максимальное время хода, мс.
+		uint8_t load;				// Нагрузка в PowerBudget.
+	};
 
 	struct actuator_data_t
 	{
@@ -19,202 +158,727 @@ namespace TrunkHood
 		state_t prev_state;			// Пред. состояние акутатора.
 		int8_t last_rx_position;	// Последнее полученное значение с джостика.
 		uint32_t last_rx_time;		// Время получения последнего значение с джостика.
-	} actuator_data[2];
+		
+		uint16_t position;			// Расчётное положение, десятые доли процента (0 - закрыт, 1000 - открыт).
+		bool calibrated;			// Положение подтверждено концевым упором.
+		uint8_t target;				// Целевое положение, %, или CFG_TargetNone.
+		uint32_t travel_time;		// Выученное время полного хода при номинальном токе, мс.
+		uint32_t run_time;			// Приведённое к номинальному току время текущего хода, мс.
+		uint32_t last_update;		// Время последнего пересчёта положения.
+		uint32_t run_rest;			// Остаток run_time меньше 1 мс, мс/256/1000.
+		uint32_t position_rest;		// Остаток положения меньше 0,1%, мс*CFG_PositionMax.
+		state_t run_from;			// Состояние, из которого начат текущий ход.
+	};
 
-	// Драйвер актуатора капота
-	DRV8874 driver1( {GPIOB, GPIO_PIN_1},  {GPIOB, GPIO_PIN_0},  {GPIOB, GPIO_PIN_8}, {GPIOC, GPIO_PIN_15}, {GPIOA, ADC_CHANNEL_7} );
-	
-	// Драйвер актуатора багажника
-	DRV8874 driver2( {GPIOB, GPIO_PIN_10}, {GPIOB, GPIO_PIN_11}, {GPIOB, GPIO_PIN_9}, {GPIOC, GPIO_PIN_14}, {GPIOA, ADC_CHANNEL_0} );
+	// Фазы поиска положения.
+	enum homing_phase_t : uint8_t
+	{
+		HOMING_IDLE,		// Поиск не идёт.
+		HOMING_WAIT,		// Ожидание свободного тока в CFG_HomingBudget.
+		HOMING_LEFT,		// Пробный ход на закрытие.
+		HOMING_RIGHT,		// Пробный ход на открытие.
+		HOMING_RETRY,		// Пауза перед повтором.
+	};
 
+	struct homing_t
+	{
+		homing_phase_t phase;
+		uint32_t start;				// Начало фазы или окончание разгона.
+		uint32_t last_sample;		// Время последнего отсчёта тока.
+		uint8_t samples;			// Кол-во отсчётов в текущей фазе.
+		uint8_t above;				// Кол-во отсчётов выше CFG_IdleCurrent.
+		uint8_t retries;			// Кол-во выполненных повторов.
+		uint8_t event;				// Событие драйвера во время пробного хода.
+	};
 
-	state_t FindPosition(DRV8874 &driver)
+	struct actuator_t
 	{
-		state_t state;
-		uint16_t current;
+		actuator_t(const actuator_config_t &config) : config(config), driver(config.in1, config.in2, config.en, config.fault, config.current), data(), homing()
+		{
+		}
+		
+		const actuator_config_t &config;
+		DRV8874 driver;
+		actuator_data_t data;
+		homing_t homing;
+	};
 
-		driver.ActionLeft();
-		HAL_Delay(CFG_FindDelay);
-		current = driver.GetCurrent(true);
-		if( current > CFG_IdleCurrent )
+	// Массив актуаторов, собирается из таблицы конфигурации при компиляции.
+	template <uint8_t N>
+	struct actuator_array_t
+	{
+		template <size_t... I>
+		actuator_array_t(const actuator_config_t (&config)[N], std::index_sequence<I...>) : item{ config[I]... }
 		{
-			driver.ActionRight();
-			HAL_Delay(CFG_FindDelay);
-			current = driver.GetCurrent(true);
-			if( current > CFG_IdleCurrent )
-			{
-				state = STATE_STOPPED;
-			}
-			else
-			{
-				state = STATE_OPENED;
-			}
 		}
-		else
+		
+		actuator_array_t(const actuator_config_t (&config)[N]) : actuator_array_t(config, std::make_index_sequence<N>())
+		{
+		}
+		
+		actuator_t &operator[](uint8_t index)
+		{
+			return item[index];
+		}
+		
+		actuator_t *begin()
 		{
-			state = STATE_CLOSED;
+			return item;
 		}
-		driver.ActionStop();
 		
-		return state;
+		actuator_t *end()
+		{
+			return item + N;
+		}
+		
+		actuator_t item[N];
+	};
+
+	// Актуаторы. Индекс в таблице - индекс в привязке к CAN объектам (CANLib::CFG_ActuatorBindings) и поле в obj_actuator_position.
+	static const actuator_config_t CFG_Actuators[] = 
+	{
+		// Капот
+		{ {GPIOB, GPIO_PIN_1},  {GPIOB, GPIO_PIN_0},  {GPIOB, GPIO_PIN_8}, {GPIOC, GPIO_PIN_15}, {GPIOA, ADC_CHANNEL_7}, &htim3, TIM_CHANNEL_4, TIM_CHANNEL_3, CFG_HoodDetector, CFG_HoodProtection, 30000, PowerBudget::LOAD_HOOD },
+		
+		// Багажник
+		{ {GPIOB, GPIO_PIN_10}, {GPIOB, GPIO_PIN_11}, {GPIOB, GPIO_PIN_9}, {GPIOC, GPIO_PIN_14}, {GPIOA, ADC_CHANNEL_0}, &htim2, TIM_CHANNEL_3, TIM_CHANNEL_4, CFG_TrunkDetector, CFG_TrunkProtection, 30000, PowerBudget::LOAD_TRUNK },
+	};
+	static constexpr uint8_t CFG_ActuatorsCount = sizeof(CFG_Actuators) / sizeof(CFG_Actuators[0]);
+
+	actuator_array_t<CFG_ActuatorsCount> actuators(CFG_Actuators);
+	
+	uint16_t homing_current = 0;		// Ток, занятый актуаторами, которые сейчас ищут положение, мА.
+	
+	// Сохраняемое во flash состояние актуаторов, в порядке CFG_Actuators.
+	struct persist_t
+	{
+		struct
+		{
+			state_t state;
+			bool calibrated;
+			uint16_t position;
+			uint32_t travel_time;
+		} actuator[CFG_ActuatorsCount];
+	};
+	
+	FlashStorage<persist_t> storage(CFG_StoragePage0, CFG_StoragePage1, FLASH_PAGE_SIZE);
+	// Страницы лежат за концом образа прошивки, FLASH_IMAGE_SIZE задаётся в platformio.ini.
+	static_assert(CFG_StoragePage0 >= FLASH_BASE + FLASH_IMAGE_SIZE && CFG_StoragePage1 >= FLASH_BASE + FLASH_IMAGE_SIZE, "TrunkHood storage pages overlap the firmware image");
+	bool storage_clean = false;		// Сохранённое состояние совпадает с действительным.
+	bool storage_save = false;		// Ход завершён, состояние нужно сохранить после остановки всех актуаторов.
+	
+	// Начало хода: сохранённое положение больше не действительно.
+	void StorageInvalidate()
+	{
+		if(storage_clean == false) return;
+		
+		storage.Invalidate();
+		storage_clean = false;
+		
+		return;
+	}
+	
+	// Сохраняет состояние, когда ни один актуатор не движется и не ищет положение.
+	void StorageSave()
+	{
+		persist_t persist = {};
+		for(uint8_t i = 0; i < CFG_ActuatorsCount; ++i)
+		{
+			actuator_t &actuator = actuators[i];
+			DRV8874::direction_t dir = actuator.driver.GetState();
+			if(dir == DRV8874::DIR_LEFT || dir == DRV8874::DIR_RIGHT || actuator.driver.IsReversing() == true || actuator.homing.phase != HOMING_IDLE) return;
+			
+			persist.actuator[i].state = actuator.data.state;
+			persist.actuator[i].calibrated = actuator.data.calibrated;
+			persist.actuator[i].position = actuator.data.position;
+			persist.actuator[i].travel_time = actuator.data.travel_time;
+		}
+		
+		storage_save = false;
+		storage_clean = storage.Save(persist);
+		
+		DEBUG_LOG_TOPIC("ACT", "state saved: %d\n", storage_clean);
+		
+		return;
 	}
 
-	void LogicToggle(DRV8874 &driver, actuator_data_t &data)
+
+	// Устанавливает положение по известному состоянию актуатора.
+	void Calibrate(actuator_data_t &data, state_t state)
 	{
-		switch(data.state)
+		switch(state)
 		{
-			case STATE_CLOSED:
+			case STATE_CLOSED: { data.position = 0; data.calibrated = true; break; }
+			case STATE_OPENED: { data.position = CFG_PositionMax; data.calibrated = true; break; }
+			default: { data.position = CFG_PositionMax / 2; data.calibrated = false; break; }
+		}
+		
+		return;
+	}
+	
+	// Интегрирует время хода с учётом направления и тока: под нагрузкой актуатор движется медленнее.
+	// Вызывается каждый проход Loop() с dt 0-1 мс, поэтому дробные части переносятся в следующий вызов.
+	void UpdatePosition(actuator_t &actuator, uint32_t current_time)
+	{
+		DRV8874 &driver = actuator.driver;
+		actuator_data_t &data = actuator.data;
+		
+		uint32_t dt = current_time - data.last_update;
+		data.last_update = current_time;
+		
+		DRV8874::direction_t dir = driver.GetState();
+		if(dir != DRV8874::DIR_LEFT && dir != DRV8874::DIR_RIGHT) return;
+		
+		// Вес скорости в 1/256: 256 при номинальном токе, 0 при токе остановки.
+		uint16_t current = driver.GetCurrent();
+		int32_t weight = 256;
+		if(current > CFG_NominalCurrent)
+		{
+			weight = (current >= CFG_StallCurrent) ? 0 : (256 * (CFG_StallCurrent - current)) / (CFG_StallCurrent - CFG_NominalCurrent);
+		}
+		
+		// Скорость пропорциональна скважности ШИМ.
+		uint64_t run = (uint64_t)dt * weight * driver.GetDuty() + data.run_rest;
+		uint32_t effective = run / (256 * 1000);
+		data.run_rest = run % (256 * 1000);
+		data.run_time += effective;
+		
+		uint64_t travel = (uint64_t)effective * CFG_PositionMax + data.position_rest;
+		int32_t delta = travel / data.travel_time;
+		data.position_rest = travel % data.travel_time;
+		int32_t position = (dir == DRV8874::DIR_RIGHT) ? data.position + delta : data.position - delta;
+		if(position < 0) position = 0;
+		if(position > CFG_PositionMax) position = CFG_PositionMax;
+		data.position = position;
+		
+		return;
+	}
+	
+	// Концевой упор достигнут: положение известно точно, полный ход от упора до упора уточняет время хода.
+	void OnEndStop(actuator_data_t &data, state_t state)
+	{
+		bool full_travel = (data.calibrated == true) && ( (state == STATE_OPENED && data.run_from == STATE_CLOSED) || (state == STATE_CLOSED && data.run_from == STATE_OPENED) );
+		if(full_travel == true)
+		{
+			data.travel_time = (data.travel_time + data.run_time) / 2;
+		}
+		
+		Calibrate(data, state);
+		
+		return;
+	}
+	
+	// Начало хода, запоминается исходное состояние для обучения времени хода.
+	void OnRunStart(actuator_data_t &data)
+	{
+		data.run_from = data.state;
+		data.run_time = 0;
+		data.run_rest = 0;
+		data.position_rest = 0;
+		
+		return;
+	}
+	
+	inline bool IsRunning(actuator_data_t &data)
+	{
+		return data.state == STATE_OPENING || data.state == STATE_CLOSING;
+	}
+	
+	inline bool IsHoming(actuator_t &actuator)
+	{
+		return actuator.homing.phase != HOMING_IDLE;
+	}
+	
+	// Останавливает пробный ход и освобождает ток.
+	void HomingRelease(actuator_t &actuator)
+	{
+		homing_t &homing = actuator.homing;
+		if(homing.phase == HOMING_LEFT || homing.phase == HOMING_RIGHT)
+		{
+			actuator.driver.ActionStop();
+			homing_current -= actuator.config.detector.stall_current;
+		}
+		
+		return;
+	}
+	
+	void HomingFinish(actuator_t &actuator, state_t state)
+	{
+		HomingRelease(actuator);
+		actuator.homing.phase = HOMING_IDLE;
+		
+		actuator.data.state = state;
+		Calibrate(actuator.data, state);
+		storage_save = true;
+		
+		DEBUG_LOG_TOPIC("ACT", "homing done, state: %d, retries: %d\n", state, actuator.homing.retries);
+		
+		return;
+	}
+	
+	void HomingProbe(actuator_t &actuator, homing_phase_t phase, uint32_t current_time)
+	{
+		homing_t &homing = actuator.homing;
+		homing.phase = phase;
+		homing.start = current_time;
+		homing.last_sample = current_time;
+		homing.samples = 0;
+		homing.above = 0;
+		homing.event = DRV8874::EVENT_NONE;
+		
+		StorageInvalidate();
+		actuator.driver.Action( (phase == HOMING_LEFT) ? DRV8874::DIR_LEFT : DRV8874::DIR_RIGHT );
+		
+		return;
+	}
+	
+	void HomingRetry(actuator_t &actuator, uint32_t current_time)
+	{
+		homing_t &homing = actuator.homing;
+		if(homing.retries >= CFG_HomingRetries)
+		{
+			// Положение так и не определилось: актуатор считается остановленным в неизвестном месте.
+			return HomingFinish(actuator, STATE_STOPPED);
+		}
+		
+		HomingRelease(actuator);
+		++homing.retries;
+		homing.phase = HOMING_RETRY;
+		homing.start = current_time;
+		
+		return;
+	}
+	
+	// Неблокирующий поиск положения: ход на закрытие, при наличии тока - ход на открытие.
+	// Нет тока при ходе на закрытие - актуатор закрыт, при ходе на открытие - открыт, ток в обе стороны - остановлен посередине.
+	void HomingStep(actuator_t &actuator, uint32_t current_time)
+	{
+		homing_t &homing = actuator.homing;
+		DRV8874 &driver = actuator.driver;
+		
+		switch(homing.phase)
+		{
+			case HOMING_RETRY:
 			{
-				driver.ActionRight();
-				data.prev_state = data.state;
-				data.state = STATE_OPENING;
+				if(current_time - homing.start >= CFG_HomingRetryDelay)
+				{
+					homing.phase = HOMING_WAIT;
+				}
 				
 				break;
 			}
-			case STATE_OPENED:
+			case HOMING_WAIT:
 			{
-				driver.ActionLeft();
-				data.prev_state = data.state;
-				data.state = STATE_CLOSING;
+				uint16_t need = actuator.config.detector.stall_current;
+				if(homing_current + need > CFG_HomingBudget && homing_current != 0) break;
 				
-				break;
-			}
-			case STATE_CLOSING:
-			case STATE_OPENING:
-			{
-				driver.ActionStop();
-				data.prev_state = data.state;
-				data.state = STATE_STOPPED;
+				homing_current += need;
+				HomingProbe(actuator, HOMING_LEFT, current_time);
 				
 				break;
 			}
-			case STATE_STOPPED:
+			case HOMING_LEFT:
+			case HOMING_RIGHT:
 			{
-				state_t tmp = data.prev_state;
-				data.prev_state = data.state;
-				if(tmp == STATE_CLOSING)
+				// Отсчёт гашения начинается после разгона.
+				if(driver.IsRamping() == true)
 				{
-					driver.ActionRight();
-					data.state = STATE_OPENING;
+					homing.start = current_time;
+					break;
 				}
-				if(tmp == STATE_OPENING)
+				
+				bool low;
+				if(homing.event != DRV8874::EVENT_NONE)
+				{
+					// Детектор драйвера остановил ход сам: упор означает отсутствие тока, остальное - повтор.
+					if(homing.event != DRV8874::EVENT_ENDSTOP) return HomingRetry(actuator, current_time);
+					low = true;
+				}
+				else
 				{
-					driver.ActionLeft();
-					data.state = STATE_CLOSING;
+					if(current_time - homing.start < CFG_HomingBlanking) break;
+					if(current_time - homing.last_sample < CFG_HomingInterval) break;
+					homing.last_sample = current_time;
+					
+					if(driver.GetCurrent() > CFG_IdleCurrent) ++homing.above;
+					if(++homing.samples < CFG_HomingSamples) break;
+					
+					// Часть отсчётов выше порога, часть ниже - результат неоднозначный.
+					if(homing.above != 0 && homing.above != homing.samples) return HomingRetry(actuator, current_time);
+					low = (homing.above == 0);
+				}
+				
+				if(homing.phase == HOMING_LEFT)
+				{
+					if(low == true) return HomingFinish(actuator, STATE_CLOSED);
+					HomingProbe(actuator, HOMING_RIGHT, current_time);
+				}
+				else
+				{
+					HomingFinish(actuator, (low == true) ? STATE_OPENED : STATE_STOPPED);
 				}
 				
 				break;
 			}
 			default:
 			{
-				driver.ActionStop();
-				data.prev_state = STATE_OPENING;
-				data.state = STATE_STOPPED;
-
 				break;
 			}
 		}
-
+		
 		return;
 	}
-
-	void TimeLogicToggleOff(DRV8874 &driver, actuator_data_t &data)
+	
+	// Команда во время поиска положения прерывает поиск, положение остаётся неизвестным.
+	void HomingAbort(actuator_t &actuator)
 	{
-		if(driver.GetCurrent() < CFG_IdleCurrent)
+		HomingRelease(actuator);
+		actuator.homing.phase = HOMING_IDLE;
+		
+		return;
+	}
+	
+	// Пуск мотора через PowerBudget. Пока пуск отложен, мост выключен, а положение не меняется (скважность 0).
+	void Drive(actuator_t &actuator, DRV8874::direction_t dir, uint8_t speed)
+	{
+		PowerBudget::Request(actuator.config.load, [](uint8_t load, uint16_t dir, uint16_t speed) -> bool
 		{
-			if(data.state == STATE_CLOSING)
+			for(actuator_t &actuator : actuators)
 			{
-				driver.ActionOff();
-				data.prev_state = data.state;
-				data.state = STATE_CLOSED;
-				data.last_rx_position = 0;
+				if(actuator.config.load == load) actuator.driver.Action((DRV8874::direction_t)dir, speed);
+			}
+			
+			return true;
+		}, dir, speed);
+		
+		// Мотор, который ещё крутится в другую сторону, выбегает до отложенного пуска.
+		DRV8874::direction_t state = actuator.driver.GetState();
+		if(PowerBudget::IsPending(actuator.config.load) == true && (state == DRV8874::DIR_LEFT || state == DRV8874::DIR_RIGHT))
+		{
+			actuator.driver.ActionOff();
+		}
+		
+		return;
+	}
+	
+	// Выполняет переход по таблице. Любое событие сбрасывает цель и последнее значение джойстика,
+	// источники событий восстанавливают их сами.
+	void Dispatch(actuator_t &actuator, event_t event, uint8_t speed = 100)
+	{
+		DRV8874 &driver = actuator.driver;
+		actuator_data_t &data = actuator.data;
+		if(IsHoming(actuator) == true)
+		{
+			HomingAbort(actuator);
+		}
+		
+		const transition_t &transition = CFG_Transitions[data.state][event];
+		
+		data.target = CFG_TargetNone;
+		data.last_rx_position = 0;
+		PowerBudget::Cancel(actuator.config.load);
+		
+		switch(transition.action)
+		{
+			case ACTION_OPEN:
+			{
+				StorageInvalidate();
+				Drive(actuator, DRV8874::DIR_RIGHT, speed);
+				OnRunStart(data);
+				
+				break;
+			}
+			case ACTION_CLOSE:
+			{
+				StorageInvalidate();
+				Drive(actuator, DRV8874::DIR_LEFT, speed);
+				OnRunStart(data);
+				
+				break;
 			}
-			if(data.state == STATE_OPENING)
+			case ACTION_STOP:
+			{
+				driver.ActionSoftStop();
+				
+				break;
+			}
+			case ACTION_REVERSE:
+			{
+				return Dispatch(actuator, (data.prev_state == STATE_CLOSING) ? EVENT_OPEN : EVENT_CLOSE, speed);
+			}
+			case ACTION_ARRIVE:
 			{
 				driver.ActionOff();
-				data.prev_state = data.state;
-				data.state = STATE_OPENED;
-				data.last_rx_position = 0;
+				OnEndStop(data, transition.next);
+				
+				break;
+			}
+			default:
+			{
+				break;
 			}
 		}
 		
+		if(transition.next != data.state)
+		{
+			// Ход завершён: новое состояние сохраняется во flash.
+			if(IsRunning(data) == true) storage_save = true;
+			
+			data.prev_state = data.state;
+			data.state = transition.next;
+		}
+		
 		return;
 	}
+	
+	void LogicToggle(actuator_t &actuator)
+	{
+		return Dispatch(actuator, EVENT_TOGGLE);
+	}
 
-	void LogicSet(DRV8874 &driver, actuator_data_t &data, int8_t stick_position)
+	void TimeLogicToggleOff(actuator_t &actuator)
 	{
+		// Во время разгона, реверса и до отложенного пуска ток ещё мал и не говорит об упоре.
+		if(actuator.driver.IsRamping() == true || actuator.driver.IsReversing() == true || PowerBudget::IsPending(actuator.config.load) == true) return;
 		
-		data.prev_state = data.state;
-		if(stick_position > 0 && data.last_rx_position <= 0)
+		if(IsRunning(actuator.data) == true && actuator.driver.GetCurrent() < CFG_IdleCurrent)
 		{
-			driver.ActionRight();
-			data.state = STATE_OPENING;
+			Dispatch(actuator, EVENT_ENDSTOP);
 		}
-		else if(stick_position < 0 && data.last_rx_position >= 0)
+		
+		return;
+	}
+
+	// Скорость по отклонению джойстика: от CFG_MinSpeed до 100%.
+	inline uint8_t StickSpeed(int8_t stick_position)
+	{
+		uint8_t value = (stick_position < 0) ? -stick_position : stick_position;
+		if(value > 100) value = 100;
+		
+		return CFG_MinSpeed + ((100 - CFG_MinSpeed) * value) / 100;
+	}
+	
+	// Повтор того же положения джойстика только продлевает CFG_StickIdleTime. Возвращает false, если команда ничего не изменила.
+	bool LogicSet(actuator_t &actuator, int8_t stick_position)
+	{
+		actuator_data_t &data = actuator.data;
+		int8_t last_rx_position = data.last_rx_position;
+		
+		data.last_rx_time = HAL_GetTick();
+		if(stick_position == last_rx_position && data.target == CFG_TargetNone) return false;
+		
+		data.target = CFG_TargetNone;
+		
+		if(stick_position > 0 && last_rx_position <= 0)
 		{
-			driver.ActionLeft();
-			data.state = STATE_CLOSING;
+			Dispatch(actuator, EVENT_OPEN, StickSpeed(stick_position));
 		}
-		else if(stick_position == 0 && data.last_rx_position != 0)
+		else if(stick_position < 0 && last_rx_position >= 0)
+		{
+			Dispatch(actuator, EVENT_CLOSE, StickSpeed(stick_position));
+		}
+		else if(stick_position == 0 && last_rx_position != 0)
+		{
+			Dispatch(actuator, EVENT_STOP);
+		}
+		
+		if(stick_position != 0 && IsRunning(data) == true)
 		{
-			driver.ActionStop();
-			data.state = STATE_STOPPED;
+			actuator.driver.SetSpeed(StickSpeed(stick_position));
 		}
 		data.last_rx_position = stick_position;
-		data.last_rx_time = HAL_GetTick();
 		
-		return;
+		return true;
 	}
 
-	void TimeLogicSetOff(DRV8874 &driver, actuator_data_t &data, uint32_t current_time)
+	void TimeLogicSetOff(actuator_t &actuator, uint32_t current_time)
 	{
-		if(current_time - data.last_rx_time > CFG_StickIdleTime && (data.state == STATE_OPENING || data.state == STATE_CLOSING) && (data.last_rx_position != -100 && data.last_rx_position != 100 && data.last_rx_position != 0))
+		actuator_data_t &data = actuator.data;
+		
+		if(current_time - data.last_rx_time > CFG_StickIdleTime && IsRunning(data) == true && (data.last_rx_position != -100 && data.last_rx_position != 100 && data.last_rx_position != 0))
 		{
-			driver.ActionStop();
-			data.prev_state = data.state;
-			data.state = STATE_STOPPED;
-			data.last_rx_position = 0;
+			Dispatch(actuator, EVENT_STOP);
+		}
+		
+		return;
+	}
+	
+	
+	// Вызывается из HAL_GPIO_EXTI_Callback(): nFAULT драйвера, мост выключается прямо в прерывании.
+	inline void FaultIRQ(uint16_t pin, uint32_t stamp)
+	{
+		for(actuator_t &actuator : actuators)
+		{
+			if(actuator.config.fault.Pin == pin)
+			{
+				actuator.driver.FaultIRQ(stamp);
+			}
+		}
+		
+		return;
+	}
+	
+	// События драйвера: упор подтверждает положение, остальные события означают, что актуатор остановлен.
+	void OnDriverEvent(actuator_t &actuator, uint8_t code)
+	{
+		if(code == DRV8874::EVENT_FAULT)
+		{
+			DEBUG_LOG_TOPIC("ACT", "nFAULT, bridge off in %lu cycles (max %lu)\n", actuator.driver.GetFaultLatency(), actuator.driver.GetFaultLatency(true));
+		}
+		if(code == DRV8874::EVENT_THERMAL)
+		{
+			DEBUG_LOG_TOPIC("ACT", "I2t limit, heat %d%%, blocked\n", actuator.driver.GetHeat());
+		}
+		
+		// Во время поиска положения события разбирает HomingStep().
+		if(IsHoming(actuator) == true)
+		{
+			actuator.homing.event = code;
+			
+			return;
+		}
+		
+		return Dispatch(actuator, (code == DRV8874::EVENT_ENDSTOP) ? EVENT_ENDSTOP : EVENT_FAULT);
+	}
+	
+	// Движение к заданному положению, %.
+	void LogicTarget(actuator_t &actuator, uint8_t target)
+	{
+		if(target > 100) return;
+		
+		int32_t diff = (int32_t)target * 10 - actuator.data.position;
+		if(diff > -(int32_t)CFG_PositionTolerance && diff < (int32_t)CFG_PositionTolerance)
+		{
+			return;
+		}
+		
+		Dispatch(actuator, (diff > 0) ? EVENT_OPEN : EVENT_CLOSE);
+		actuator.data.target = target;
+		
+		return;
+	}
+	
+	void TimeLogicTargetOff(actuator_t &actuator)
+	{
+		actuator_data_t &data = actuator.data;
+		if(data.target == CFG_TargetNone) return;
+		
+		int32_t target = (int32_t)data.target * 10;
+		bool reached = (data.state == STATE_OPENING && data.position + CFG_PositionTolerance >= target) || 
+					   (data.state == STATE_CLOSING && data.position <= target + CFG_PositionTolerance);
+		
+		// Крайние значения доводим до упора, чтобы заодно откалибровать положение.
+		if(reached == true && target != 0 && target != CFG_PositionMax)
+		{
+			Dispatch(actuator, EVENT_STOP);
+		}
+		else if(IsRunning(data) == false)
+		{
+			data.target = CFG_TargetNone;
 		}
 		
 		return;
 	}
 	
+	// Положение, %, или 0xFF, пока идёт поиск положения.
+	inline uint8_t GetPosition(actuator_t &actuator)
+	{
+		if(IsHoming(actuator) == true) return 0xFF;
+		
+		return (actuator.data.position + 5) / 10;
+	}
 	
 	inline void Setup()
 	{
-		driver1.Init();
-		driver2.Init();
-
-		driver1.SetTimeout(30000);
-		driver2.SetTimeout(30000);
-
-		driver1.SetCurrentParam(CFG_RefVoltage, CFG_LoadResistance);
-		driver2.SetCurrentParam(CFG_RefVoltage, CFG_LoadResistance);
-
-		actuator_data[0].prev_state = STATE_CLOSING;
-		actuator_data[1].prev_state = STATE_CLOSING;
-		actuator_data[0].state = FindPosition(driver1);
-		actuator_data[1].state = FindPosition(driver2);
+		// После чистой остановки состояние восстанавливается из flash без поиска положения.
+		persist_t persist;
+		bool loaded = storage.Load(persist, storage_clean);
+		storage_clean = storage_clean && loaded;
+		
+		for(uint8_t i = 0; i < CFG_ActuatorsCount; ++i)
+		{
+			actuator_t &actuator = actuators[i];
+			DRV8874 &driver = actuator.driver;
+			
+			if(actuator.config.htim != nullptr)
+			{
+				driver.SetPWM(actuator.config.htim, actuator.config.channel_in1, actuator.config.channel_in2);
+			}
+			driver.Init();
+			driver.SetTimeout(actuator.config.timeout);
+			driver.SetCurrentParam(CFG_RefVoltage, CFG_LoadResistance);
+			driver.SetDetectorParam(actuator.config.detector);
+			driver.SetProtectionParam(actuator.config.protection);
+			driver.SetReversalParam(CFG_Reversal);
+			
+			driver.SetRamp(CFG_AccelTime, CFG_DecelTime);
+			
+			actuator_data_t &data = actuator.data;
+			data.prev_state = STATE_CLOSING;
+			data.state = STATE_UNKNOWN;
+			data.target = CFG_TargetNone;
+			data.travel_time = (loaded == true && persist.actuator[i].travel_time != 0) ? persist.actuator[i].travel_time : CFG_TravelTime;
+			data.last_update = HAL_GetTick();
+			Calibrate(data, data.state);
+			
+			if(storage_clean == true)
+			{
+				data.state = persist.actuator[i].state;
+				data.calibrated = persist.actuator[i].calibrated;
+				data.position = persist.actuator[i].position;
+			}
+			else
+			{
+				// Положение ищется в фоне, из Loop().
+				actuator.homing.phase = HOMING_WAIT;
+			}
+		}
+		
+		DEBUG_LOG_TOPIC("ACT", "stored state: %d, clean: %d\n", loaded, storage_clean);
 		
 		return;
 	}
 	
 	inline void Loop(uint32_t &current_time)
 	{
-		driver1.Processing(current_time);
-		driver2.Processing(current_time);
+		for(actuator_t &actuator : actuators)
+		{
+			actuator.driver.Processing(current_time);
+			HomingStep(actuator, current_time);
+			UpdatePosition(actuator, current_time);
+			TimeLogicTargetOff(actuator);
+		}
 
 		static uint32_t last_time = 0;
 		if(current_time - last_time > 50)
 		{
 			last_time = current_time;
 
-			TimeLogicToggleOff(driver1, actuator_data[0]);
-			TimeLogicToggleOff(driver2, actuator_data[1]);
+			for(actuator_t &actuator : actuators)
+			{
+				TimeLogicToggleOff(actuator);
+			}
 		}
 
-		TimeLogicSetOff(driver1, actuator_data[0], current_time);
-		TimeLogicSetOff(driver2, actuator_data[1], current_time);
+		for(actuator_t &actuator : actuators)
+		{
+			TimeLogicSetOff(actuator, current_time);
+		}
+		
+		static uint16_t reversals[CFG_ActuatorsCount] = {};
+		for(uint8_t i = 0; i < CFG_ActuatorsCount; ++i)
+		{
+			DRV8874 &driver = actuators[i].driver;
+			if(driver.GetReversalCount() == reversals[i]) continue;
+			reversals[i] = driver.GetReversalCount();
+			
+			DEBUG_LOG_TOPIC("ACT", "reversal in %d ms (max %d ms)\n", driver.GetReversalLatency(), driver.GetReversalLatency(true));
+		}
+		
+		if(storage_save == true)
+		{
+			StorageSave();
+		}
 		
 		
 		
@@ -223,4 +887,4 @@ namespace TrunkHood
 		return;
 	}
 	
-}
+}
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <inttypes.h>
+#include <string.h>
 #include "MovingAverage.h"
 
 extern ADC_HandleTypeDef hadc1;
@@ -11,6 +12,9 @@ class DRV8874
 	static constexpr float _current_scaling = 0.45f;
 	static constexpr uint32_t _adc_size = 4095;
 	static constexpr uint32_t _processing_tick = 15;
+	static constexpr uint32_t _detector_tick = 5;
+	static constexpr uint8_t _window_size = 8;
+	static constexpr uint16_t _duty_max = 1000;
 	
 	using error_event_t = void (*)(/*uint8_t id, */uint8_t code);
 	
@@ -24,6 +28,51 @@ class DRV8874
 		
 		enum direction_t : uint8_t { DIR_NONE, DIR_OFF, DIR_LEFT, DIR_RIGHT, DIR_STOP };
 		
+		enum event_t : uint8_t
+		{
+			EVENT_NONE = 0x00,
+			EVENT_FAULT = 0x01,			// nFAULT from the chip.
+			EVENT_TIMEOUT = 0x02,		// Run time exceeded SetTimeout().
+			EVENT_STALL = 0x03,			// Current above stall level: motor is blocked.
+			EVENT_OBSTRUCTION = 0x04,	// Current rises fast above the running plateau.
+			EVENT_ENDSTOP = 0x05,		// Current collapsed: internal limit switch opened.
+			EVENT_OVERCURRENT = 0x06,	// Current above the trip level after the inrush blanking.
+			EVENT_THERMAL = 0x07,		// I²t limit reached, runs are blocked until the motor cools down.
+		};
+		
+		// Stall and end-stop detector settings, confirm = 0 disables the detector.
+		typedef struct
+		{
+			uint16_t blanking;			// Time after start with no checks (inrush), ms.
+			uint16_t idle_current;		// Below this current the end stop is reached, mA.
+			uint16_t stall_current;		// Above this current the motor is stalled, mA.
+			uint16_t rise_current;		// Rise above the running plateau treated as obstruction, mA.
+			uint16_t slope;				// Minimal rise over the sliding window for obstruction, mA.
+			uint8_t confirm;			// Samples in a row needed to raise an event.
+		} detector_t;
+		
+		// Overcurrent trip and I²t thermal model settings, 0 disables each part.
+		typedef struct
+		{
+			uint16_t trip_current;		// Single sample above this current switches the bridge off, mA.
+			uint16_t trip_blanking;		// Time after start with no overcurrent check (inrush), ms.
+			uint16_t rated_current;		// Current the motor carries forever: no heating, cooling when idle, mA.
+			uint32_t heat_limit;		// Heat at which the motor is stopped and blocked, (0.1 A)² * ms.
+			uint8_t derate_level;		// Heat from which the speed is reduced, % of heat_limit.
+			uint8_t derate_speed;		// Speed at heat_limit, %; lineary from 100% at derate_level.
+			uint8_t resume_level;		// Heat below which a blocked motor may run again, % of heat_limit.
+		} protection_t;
+		
+		// Reversal sequence: brake, then bridge off for the dwell, then the opposite direction. 0 disables each step.
+		// A fast or heavily loaded motor coasts instead of braking, shorting its back-EMF would spike the current.
+		typedef struct
+		{
+			uint16_t brake_time;		// Bridge braked (or coasting) after the run, ms.
+			uint16_t dwell_time;		// Bridge off after the brake, ms.
+			uint16_t brake_duty;		// Above this duty the motor coasts instead of braking, 0..1000.
+			uint16_t brake_current;		// Above this current the motor coasts instead of braking, mA.
+		} reversal_t;
+		
 		DRV8874(pin_t in1, pin_t in2, pin_t en, pin_t fault, pin_t current)
 		{
 			_channel.pin_in1 = in1;
@@ -37,14 +86,44 @@ class DRV8874
 		
 		void Init()
 		{
-			_HW_PinInit(_channel.pin_in1, GPIO_MODE_OUTPUT_PP);
-			_HW_PinInit(_channel.pin_in2, GPIO_MODE_OUTPUT_PP);
+			uint32_t in_mode = (_pwm.htim != nullptr) ? GPIO_MODE_AF_PP : GPIO_MODE_OUTPUT_PP;
+			_HW_PinInit(_channel.pin_in1, in_mode);
+			_HW_PinInit(_channel.pin_in2, in_mode);
 			_HW_PinInit(_channel.pin_en, GPIO_MODE_OUTPUT_PP);
-			_HW_PinInit(_channel.pin_fault, GPIO_MODE_INPUT);
+			_HW_PinInit(_channel.pin_fault, GPIO_MODE_IT_FALLING);
 			_HW_PinInit(_channel.pin_current, GPIO_MODE_ANALOG);
 
 			HAL_ADCEx_Calibration_Start(&hadc1);
 			
+			_HW_BuildMasks();
+			
+			if(_pwm.htim != nullptr)
+			{
+				_HW_IN1(0);
+				_HW_IN2(0);
+				HAL_TIM_PWM_Start(_pwm.htim, _pwm.channel_in1);
+				HAL_TIM_PWM_Start(_pwm.htim, _pwm.channel_in2);
+			}
+			
+			return;
+		}
+		
+		// Drive IN1/IN2 from timer PWM channels instead of GPIO. Call before Init().
+		void SetPWM(TIM_HandleTypeDef *htim, uint32_t channel_in1, uint32_t channel_in2)
+		{
+			_pwm.htim = htim;
+			_pwm.channel_in1 = channel_in1;
+			_pwm.channel_in2 = channel_in2;
+			
+			return;
+		}
+		
+		// Duty ramp time from 0 to 100% (accel) and from 100% to 0 (decel), ms. 0 - no ramp.
+		void SetRamp(uint16_t accel_time, uint16_t decel_time)
+		{
+			_pwm.accel_time = accel_time;
+			_pwm.decel_time = decel_time;
+			
 			return;
 		}
 		
@@ -68,65 +147,128 @@ class DRV8874
 			_channel.timeout = timeout;
 		}
 		
-		void Action(direction_t dir)
+		void SetDetectorParam(const detector_t &param)
 		{
-			if(dir != _channel.state)
+			_detector = param;
+			
+			return;
+		}
+		
+		void SetProtectionParam(const protection_t &param)
+		{
+			_protection = param;
+			
+			return;
+		}
+		
+		// Accumulated heat, % of heat_limit.
+		uint8_t GetHeat()
+		{
+			if(_protection.heat_limit == 0) return 0;
+			
+			return ((uint64_t)_thermal.heat * 100) / _protection.heat_limit;
+		}
+		
+		bool IsBlocked()
+		{
+			return _thermal.blocked;
+		}
+		
+		void SetReversalParam(const reversal_t &param)
+		{
+			_reversal_param = param;
+			
+			return;
+		}
+		
+		// The reversed direction is requested, but the bridge is still braking or dwelling.
+		bool IsReversing()
+		{
+			return _reversal.dir != DIR_NONE;
+		}
+		
+		// nFAULT is low or its interrupt is not yet handled by Processing().
+		bool IsFault()
+		{
+			return _fault.pending == true || _HW_READ(_channel.pin_fault) == false;
+		}
+		
+		// Time from the reversal request to the start in the opposite direction, last and worst, ms.
+		// Bounded by brake_time + dwell_time + the Processing() call period.
+		uint16_t GetReversalLatency(bool max = false)
+		{
+			return (max == true) ? _reversal.latency_max : _reversal.latency;
+		}
+		
+		// Number of completed reversal sequences.
+		uint16_t GetReversalCount()
+		{
+			return _reversal.count;
+		}
+		
+		// speed: 0..100%, used only with SetPWM(). Without PWM the motor always runs at full speed.
+		void Action(direction_t dir, uint8_t speed = 100)
+		{
+			// An overheated motor is not started, EVENT_THERMAL follows in Processing().
+			if(_thermal.blocked == true && (dir == DIR_LEFT || dir == DIR_RIGHT))
 			{
-				_channel.timerun = HAL_GetTick();
+				_thermal.rejected = true;
+				dir = DIR_STOP;
 			}
 			
-			switch(dir)
+			// The bridge stays off until Processing() has handled the fault and raised EVENT_FAULT.
+			if(_fault.pending == true && (dir == DIR_LEFT || dir == DIR_RIGHT))
 			{
-				case DIR_OFF:
-				{
-					_HW_LOW(_channel.pin_in1);
-					_HW_LOW(_channel.pin_in2);
-					_HW_LOW(_channel.pin_en);
-					_channel.state = DIR_OFF;
-					
-					break;
-				}
-				case DIR_LEFT:
-				{
-					_HW_LOW(_channel.pin_in1);
-					_HW_HIGH(_channel.pin_in2);
-					_HW_HIGH(_channel.pin_en);
-					_channel.state = DIR_LEFT;
-					
-					break;
-				}
-				case DIR_RIGHT:
-				{
-					_HW_HIGH(_channel.pin_in1);
-					_HW_LOW(_channel.pin_in2);
-					_HW_HIGH(_channel.pin_en);
-					_channel.state = DIR_RIGHT;
-					
-					break;
-				}
-				case DIR_STOP:
-				{
-					_HW_HIGH(_channel.pin_in1);
-					_HW_HIGH(_channel.pin_in2);
-					_HW_HIGH(_channel.pin_en);
-					_channel.state = DIR_STOP;
-					
-					break;
-				}
-				default:
+				dir = DIR_OFF;
+			}
+			
+			// Any other command cancels a pending reversal, the same direction only changes its speed.
+			if(_reversal.dir != DIR_NONE)
+			{
+				if(dir == _reversal.dir)
 				{
-					//_HW_LOW(_channel.pin_in1);
-					//_HW_LOW(_channel.pin_in2);
-					//_HW_LOW(_channel.pin_en);
-					_channel.state = DIR_NONE;
+					_reversal.speed = speed;
 					
-					break;
+					return;
 				}
+				_reversal.dir = DIR_NONE;
 			}
 			
+			if(_ReversalStart(dir, speed) == true) return;
+			
+			return _Apply(dir, speed);
+		}
+		
+		// Called from the nFAULT EXTI interrupt: switches the bridge off at once, the event is
+		// raised later in Processing(). stamp - DWT->CYCCNT at interrupt entry, for latency measurement.
+		void FaultIRQ(uint32_t stamp)
+		{
+			_HW_Write(DIR_OFF);
+			_channel.state = DIR_OFF;
+			_channel.pending = DIR_NONE;
+			_reversal.dir = DIR_NONE;
+			
+			uint32_t latency = DWT->CYCCNT - stamp;
+			_fault.latency = latency;
+			if(latency > _fault.latency_max) _fault.latency_max = latency;
+			_fault.time = HAL_GetTick();
+			_fault.pending = true;
+			
 			return;
 		}
 		
+		// Cycles from the nFAULT interrupt entry to the bridge off, last and worst.
+		uint32_t GetFaultLatency(bool max = false)
+		{
+			return (max == true) ? _fault.latency_max : _fault.latency;
+		}
+		
+		// Time of the last nFAULT interrupt, ms.
+		uint32_t GetFaultTime()
+		{
+			return _fault.time;
+		}
+		
 		void ActionOff()
 		{
 			return Action(DIR_OFF);
@@ -147,6 +289,50 @@ class DRV8874
 			return Action(DIR_STOP);
 		}
 		
+		// Ramps the duty down, then brakes. Without PWM it is the same as ActionStop().
+		void ActionSoftStop()
+		{
+			if(_pwm.htim == nullptr || _pwm.decel_time == 0 || (_channel.state != DIR_LEFT && _channel.state != DIR_RIGHT))
+			{
+				return ActionStop();
+			}
+			
+			_pwm.target = 0;
+			_pwm.speed_ramp = true;
+			_channel.pending = DIR_STOP;
+			
+			return;
+		}
+		
+		// Changes the speed of a running motor, the duty follows the ramps.
+		void SetSpeed(uint8_t speed)
+		{
+			if(_reversal.dir != DIR_NONE)
+			{
+				_reversal.speed = speed;
+				
+				return;
+			}
+			
+			_channel.pending = DIR_NONE;
+			_SetTarget(speed);
+			_HW_ApplyDuty();
+			
+			return;
+		}
+		
+		// A commanded start or speed change is ramping; thermal derating does not count.
+		bool IsRamping()
+		{
+			return (_channel.state == DIR_LEFT || _channel.state == DIR_RIGHT) && _pwm.speed_ramp == true;
+		}
+		
+		// Current duty of a running motor, 0..1000.
+		uint16_t GetDuty()
+		{
+			return (_channel.state == DIR_LEFT || _channel.state == DIR_RIGHT) ? _pwm.duty : 0;
+		}
+		
 		void ActionInvert()
 		{
 			switch(_channel.state)
@@ -176,25 +362,53 @@ class DRV8874
 		
 		void Processing(uint32_t current_time)
 		{
-			if(current_time - last_tick < _processing_tick) return;
+			// Outside the tick: the reversal latency is bounded by the caller's loop period, not by _processing_tick.
+			// A fault cancels the sequence, the check also covers a reversal started before the interrupt returned.
+			if(_reversal.dir != DIR_NONE && _fault.pending == false)
+			{
+				_ReversalStep(current_time);
+			}
+			
+			bool running = (_channel.state == DIR_LEFT || _channel.state == DIR_RIGHT);
+			if(current_time - last_tick < (running ? _detector_tick : _processing_tick)) return;
 			last_tick = current_time;
 			
-			_channel.current.Push( _HW_GetCurrent(_channel.pin_current) );
+			uint16_t current = _HW_GetCurrent(_channel.pin_current);
+			_channel.current.Push(current);
+			
+			uint8_t code = EVENT_NONE;
+			if(running == true)
+			{
+				_Ramp(current_time);
+				code = _Detect(current, current_time);
+				
+				if(_protection.trip_current > 0 && current > _protection.trip_current && current_time - _channel.timerun >= _protection.trip_blanking)
+				{
+					ActionOff();
+					code = EVENT_OVERCURRENT;
+				}
+			}
+			
+			if(_Thermal(current, current_time) == true)
+			{
+				code = EVENT_THERMAL;
+			}
 			
-			uint8_t code = 0x00;
 			if( (_channel.state == DIR_LEFT || _channel.state == DIR_RIGHT) && current_time - _channel.timerun > _channel.timeout )
 			{
 				ActionStop();
-				code = 0x02;
+				code = EVENT_TIMEOUT;
 			}
 			
-			if( _HW_READ(_channel.pin_fault) == false )
+			// The interrupt already switched the bridge off, here the state follows it. Polling stays as a backup.
+			if( _fault.pending == true || _HW_READ(_channel.pin_fault) == false )
 			{
+				_fault.pending = false;
 				ActionOff();
-				code = 0x01;
+				code = EVENT_FAULT;
 			}
 
-			if(code != 0x00 && _error_event != nullptr)
+			if(code != EVENT_NONE && _error_event != nullptr)
 			{
 				_error_event(code);
 			}
@@ -204,6 +418,17 @@ class DRV8874
 
 	private:
 
+		typedef struct
+		{
+			uint16_t window[_window_size];	// Last raw current samples.
+			uint8_t idx;
+			uint8_t count;
+			uint32_t plateau;				// Running current level, mA * 16.
+			uint8_t idle_hits;
+			uint8_t stall_hits;
+			uint8_t rise_hits;
+		} detector_state_t;
+		
 		typedef struct
 		{
 			pin_t pin_in1;
@@ -214,29 +439,378 @@ class DRV8874
 			
 			MovingAverage<uint16_t, uint32_t, 8> current;
 			direction_t state;
+			direction_t pending;		// Applied when the soft stop ramp reaches zero.
 			uint32_t timerun;
 			uint32_t timeout;
 		} channel_t;
 		
-		bool _HW_READ(pin_t pin)
+		// One BSRR store: set bits 0..15, reset bits 16..31.
+		typedef struct
 		{
-			return HAL_GPIO_ReadPin(pin.Port, pin.Pin);
+			GPIO_TypeDef *port;
+			uint32_t bsrr;
+		} port_write_t;
+		
+		void _DetectorReset()
+		{
+			memset(&_detector_state, 0x00, sizeof(_detector_state));
+			
+			return;
 		}
 		
-		void _HW_HIGH(pin_t pin)
+		void _SetTarget(uint8_t speed)
 		{
-			HAL_GPIO_WritePin(pin.Port, pin.Pin, GPIO_PIN_SET);
+			if(_pwm.htim == nullptr)
+			{
+				_pwm.target = _duty_max;
+				_pwm.duty = _duty_max;
+				_pwm.speed_ramp = false;
+				
+				return;
+			}
+			
+			if(speed > 100) speed = 100;
+			_pwm.target = speed * (_duty_max / 100);
+			if(_pwm.target > _thermal.duty_limit) _pwm.target = _thermal.duty_limit;
+			
+			// Without a ramp in this direction the duty is set at once.
+			if((_pwm.duty < _pwm.target && _pwm.accel_time == 0) || (_pwm.duty > _pwm.target && _pwm.decel_time == 0))
+			{
+				_pwm.duty = _pwm.target;
+			}
+			_pwm.speed_ramp = (_pwm.duty != _pwm.target);
 			
 			return;
 		}
 		
-		void _HW_LOW(pin_t pin)
+		void _Ramp(uint32_t current_time)
 		{
-			HAL_GPIO_WritePin(pin.Port, pin.Pin, GPIO_PIN_RESET);
+			uint32_t step;
+			uint32_t dt = current_time - _pwm.last_ramp;
+			_pwm.last_ramp = current_time;
+			
+			if(_pwm.duty < _pwm.target)
+			{
+				step = (_pwm.accel_time > 0) ? (dt * _duty_max) / _pwm.accel_time : _duty_max;
+				_pwm.duty = (_pwm.duty + step > _pwm.target) ? _pwm.target : _pwm.duty + step;
+				_HW_ApplyDuty();
+			}
+			else if(_pwm.duty > _pwm.target)
+			{
+				step = (_pwm.decel_time > 0) ? (dt * _duty_max) / _pwm.decel_time : _duty_max;
+				_pwm.duty = (_pwm.duty < _pwm.target + step) ? _pwm.target : _pwm.duty - step;
+				_HW_ApplyDuty();
+			}
+			if(_pwm.duty == _pwm.target) _pwm.speed_ramp = false;
+			
+			if(_pwm.duty == 0 && _channel.pending != DIR_NONE)
+			{
+				Action(_channel.pending);
+			}
+			
+			return;
+		}
+		
+		// Drives the bridge, Action() without the reversal sequence.
+		void _Apply(direction_t dir, uint8_t speed = 100)
+		{
+			if(dir != _channel.state)
+			{
+				// End of a run, a reversal soon after it still waits for the rest of the sequence.
+				if(_channel.state == DIR_LEFT || _channel.state == DIR_RIGHT)
+				{
+					_reversal.run_dir = _channel.state;
+					_reversal.run_end = HAL_GetTick();
+				}
+				
+				_channel.timerun = HAL_GetTick();
+				_DetectorReset();
+				
+				// Every start and reversal ramps up from zero duty.
+				_pwm.duty = 0;
+				_pwm.last_ramp = _channel.timerun;
+			}
+			_channel.pending = DIR_NONE;
+			_SetTarget(speed);
+			
+			if(dir < DIR_OFF || dir > DIR_STOP)
+			{
+				_channel.state = DIR_NONE;
+				
+				return;
+			}
+			
+			if(_pwm.htim != nullptr)
+			{
+				// CCR preload is on: both inputs switch together at the next timer update.
+				_HW_IN1( (dir == DIR_RIGHT) ? _pwm.duty : ((dir == DIR_STOP) ? _duty_max : 0) );
+				_HW_IN2( (dir == DIR_LEFT) ? _pwm.duty : ((dir == DIR_STOP) ? _duty_max : 0) );
+			}
+			_HW_Write(dir);
+			_channel.state = dir;
+			
+			return;
+		}
+		
+		// Starts the reversal sequence when dir is opposite to a running motor or to one stopped
+		// less than brake_time + dwell_time ago. Returns false if dir can be applied at once.
+		bool _ReversalStart(direction_t dir, uint8_t speed)
+		{
+			if(dir != DIR_LEFT && dir != DIR_RIGHT) return false;
+			
+			uint32_t hold = _reversal_param.brake_time + _reversal_param.dwell_time;
+			if(hold == 0) return false;
+			
+			uint32_t time = HAL_GetTick();
+			direction_t opposite = (dir == DIR_LEFT) ? DIR_RIGHT : DIR_LEFT;
+			if(_channel.state == opposite)
+			{
+				bool brake = _pwm.duty <= _reversal_param.brake_duty && _channel.current.Get() <= _reversal_param.brake_current;
+				_Apply( (brake == true && _reversal_param.brake_time > 0) ? DIR_STOP : DIR_OFF );
+			}
+			else if(_channel.state == DIR_LEFT || _channel.state == DIR_RIGHT || _reversal.run_dir != opposite || time - _reversal.run_end >= hold)
+			{
+				return false;
+			}
+			
+			_reversal.dir = dir;
+			_reversal.speed = speed;
+			_reversal.request = time;
+			
+			return true;
+		}
+		
+		// Brake until brake_time after the run, off until the dwell ends, then the reversed direction.
+		void _ReversalStep(uint32_t current_time)
+		{
+			uint32_t elapsed = current_time - _reversal.run_end;
+			if(elapsed < _reversal_param.brake_time) return;
+			if(elapsed < (uint32_t)_reversal_param.brake_time + _reversal_param.dwell_time)
+			{
+				if(_channel.state == DIR_STOP) _Apply(DIR_OFF);
+				
+				return;
+			}
+			
+			direction_t dir = _reversal.dir;
+			_reversal.dir = DIR_NONE;
+			
+			uint32_t latency = current_time - _reversal.request;
+			_reversal.latency = latency;
+			if(latency > _reversal.latency_max) _reversal.latency_max = latency;
+			++_reversal.count;
+			
+			return _Apply(dir, _reversal.speed);
+		}
+		
+		// I²t model: heat grows with (I² - rated²) and falls at rated² when idle. Derates the
+		// speed above derate_level and blocks the motor at heat_limit. Returns true on a trip.
+		bool _Thermal(uint16_t current, uint32_t current_time)
+		{
+			uint32_t dt = current_time - _thermal.last_time;
+			_thermal.last_time = current_time;
+			
+			if(_protection.heat_limit == 0) return false;
+			
+			bool running = (_channel.state == DIR_LEFT || _channel.state == DIR_RIGHT);
+			uint32_t i = (running == true) ? current / 100 : 0;
+			uint32_t rated = _protection.rated_current / 100;
+			if(dt > 1000) dt = 1000;
+			
+			if(i > rated)
+			{
+				uint32_t add = (i * i - rated * rated) * dt;
+				_thermal.heat = (_thermal.heat + add < _thermal.heat) ? UINT32_MAX : _thermal.heat + add;
+			}
+			else
+			{
+				uint32_t sub = (rated * rated - i * i) * dt;
+				_thermal.heat = (_thermal.heat > sub) ? _thermal.heat - sub : 0;
+			}
+			
+			uint8_t heat = GetHeat();
+			
+			// Derating: duty limit falls linearly from 100% at derate_level to derate_speed at the limit.
+			_thermal.duty_limit = _duty_max;
+			if(_protection.derate_level > 0 && _protection.derate_level < 100 && heat > _protection.derate_level)
+			{
+				uint32_t over = (heat >= 100) ? 100 - _protection.derate_level : heat - _protection.derate_level;
+				uint32_t drop = ((100 - _protection.derate_speed) * over) / (100 - _protection.derate_level);
+				_thermal.duty_limit = (100 - drop) * (_duty_max / 100);
+			}
+			// Without PWM the duty is fixed at the maximum, as in _SetTarget(). Without a deceleration ramp
+			// the limit applies at once, otherwise _Ramp() brings the duty down.
+			if(running == true && _pwm.htim != nullptr && _pwm.target > _thermal.duty_limit)
+			{
+				_pwm.target = _thermal.duty_limit;
+				if(_pwm.decel_time == 0)
+				{
+					_pwm.duty = _pwm.target;
+					_HW_ApplyDuty();
+				}
+			}
+			
+			if(_thermal.blocked == true && heat < _protection.resume_level)
+			{
+				_thermal.blocked = false;
+			}
+			
+			if(running == true && heat >= 100)
+			{
+				_thermal.blocked = true;
+				ActionStop();
+				
+				return true;
+			}
+			
+			if(_thermal.rejected == true)
+			{
+				_thermal.rejected = false;
+				
+				return true;
+			}
+			
+			return false;
+		}
+		
+		uint8_t _Detect(uint16_t current, uint32_t current_time)
+		{
+			if(_detector.confirm == 0) return EVENT_NONE;
+			if(current_time - _channel.timerun < _detector.blanking) return EVENT_NONE;
+			
+			// Current follows the duty while a commanded ramp runs: wait for a steady duty. A thermal
+			// limit lowers the duty slowly and keeps the detector running, the plateau follows it.
+			if(_pwm.speed_ramp == true)
+			{
+				_DetectorReset();
+				return EVENT_NONE;
+			}
+			
+			detector_state_t &d = _detector_state;
+			uint16_t oldest = d.window[d.idx];
+			d.window[d.idx] = current;
+			d.idx = (d.idx + 1) % _window_size;
+			if(d.count < _window_size)
+			{
+				// Window is not full yet: plateau follows the current directly.
+				++d.count;
+				d.plateau = (uint32_t)current << 4;
+				
+				return EVENT_NONE;
+			}
+			
+			uint16_t plateau = d.plateau >> 4;
+			int32_t rise = (int32_t)current - (int32_t)oldest;
+			
+			d.idle_hits = (current < _detector.idle_current) ? d.idle_hits + 1 : 0;
+			d.stall_hits = (current > _detector.stall_current) ? d.stall_hits + 1 : 0;
+			d.rise_hits = (rise >= _detector.slope && current > plateau + _detector.rise_current) ? d.rise_hits + 1 : 0;
+			
+			// Plateau only follows slow changes, a fast rise must not raise it.
+			if(d.rise_hits == 0)
+			{
+				d.plateau = d.plateau - (d.plateau >> 3) + ((uint32_t)current << 1);
+			}
+			
+			if(d.idle_hits >= _detector.confirm)
+			{
+				ActionOff();
+				return EVENT_ENDSTOP;
+			}
+			if(d.stall_hits >= _detector.confirm)
+			{
+				ActionStop();
+				return EVENT_STALL;
+			}
+			if(d.rise_hits >= _detector.confirm)
+			{
+				ActionStop();
+				return EVENT_OBSTRUCTION;
+			}
+			
+			return EVENT_NONE;
+		}
+		
+		// Writes the duty to the driven input of a running motor.
+		void _HW_ApplyDuty()
+		{
+			if(_pwm.htim == nullptr) return;
+			
+			if(_channel.state == DIR_LEFT) _HW_IN2(_pwm.duty);
+			if(_channel.state == DIR_RIGHT) _HW_IN1(_pwm.duty);
+			
+			return;
+		}
+		
+		void _HW_IN1(uint16_t duty)
+		{
+			__HAL_TIM_SET_COMPARE(_pwm.htim, _pwm.channel_in1, _HW_Compare(duty));
+			
+			return;
+		}
+		
+		void _HW_IN2(uint16_t duty)
+		{
+			__HAL_TIM_SET_COMPARE(_pwm.htim, _pwm.channel_in2, _HW_Compare(duty));
 			
 			return;
 		}
 		
+		// Compare value for the duty, ARR + 1 keeps the output high for the whole period.
+		uint32_t _HW_Compare(uint16_t duty)
+		{
+			return ((__HAL_TIM_GET_AUTORELOAD(_pwm.htim) + 1) * duty) / _duty_max;
+		}
+		
+		// Precomputes the BSRR stores of every direction, one per GPIO port. Pins on the same
+		// port change in one atomic store, so the bridge never passes through intermediate states.
+		// With PWM, IN1/IN2 belong to the timer and only EN is written.
+		void _HW_BuildMasks()
+		{
+			// Levels of IN1 (bit 0), IN2 (bit 1), EN (bit 2) for DIR_OFF, DIR_LEFT, DIR_RIGHT, DIR_STOP.
+			static constexpr uint8_t levels[] = { 0b000, 0b110, 0b101, 0b111 };
+			const pin_t pins[] = { _channel.pin_in1, _channel.pin_in2, _channel.pin_en };
+			
+			memset(&_masks, 0x00, sizeof(_masks));
+			for(uint8_t dir = DIR_OFF; dir <= DIR_STOP; ++dir)
+			{
+				for(uint8_t i = (_pwm.htim != nullptr) ? 2 : 0; i < 3; ++i)
+				{
+					bool high = levels[dir - DIR_OFF] & (1 << i);
+					uint32_t bits = high ? pins[i].Pin : (uint32_t)pins[i].Pin << 16;
+					
+					for(port_write_t &write : _masks[dir])
+					{
+						if(write.port != nullptr && write.port != pins[i].Port) continue;
+						
+						write.port = pins[i].Port;
+						write.bsrr |= bits;
+						
+						break;
+					}
+				}
+			}
+			
+			return;
+		}
+		
+		void _HW_Write(direction_t dir)
+		{
+			for(const port_write_t &write : _masks[dir])
+			{
+				if(write.port == nullptr) break;
+				
+				write.port->BSRR = write.bsrr;
+			}
+			
+			return;
+		}
+		
+		bool _HW_READ(pin_t pin)
+		{
+			return HAL_GPIO_ReadPin(pin.Port, pin.Pin);
+		}
+		
 		uint16_t _HW_GetCurrent(pin_t pin)
 		{
 			_adc_config.Channel = pin.Pin;
@@ -263,6 +837,55 @@ class DRV8874
 		}
 		
 		channel_t _channel;
+		port_write_t _masks[DIR_STOP + 1][3];
+		
+		struct
+		{
+			TIM_HandleTypeDef *htim;
+			uint32_t channel_in1;
+			uint32_t channel_in2;
+			uint16_t accel_time;
+			uint16_t decel_time;
+			uint16_t duty;			// Current duty, 0..1000.
+			uint16_t target;		// Target duty, 0..1000.
+			uint32_t last_ramp;
+			bool speed_ramp;		// The duty ramps to a commanded target, not to a thermal limit.
+		} _pwm = {};
+		
+		struct
+		{
+			volatile bool pending;
+			volatile uint32_t time;
+			volatile uint32_t latency;
+			volatile uint32_t latency_max;
+		} _fault = {};
+		
+		detector_t _detector = {};
+		detector_state_t _detector_state = {};
+		
+		protection_t _protection = {};
+		reversal_t _reversal_param = {};
+		
+		struct
+		{
+			volatile direction_t dir;	// Direction waiting for the sequence to end, DIR_NONE - none, cleared by FaultIRQ().
+			uint8_t speed;
+			uint32_t request;		// Time of the reversal request.
+			direction_t run_dir;	// Direction of the last run.
+			uint32_t run_end;		// End time of the last run.
+			uint16_t latency;		// Request to start, ms.
+			uint16_t latency_max;
+			uint16_t count;
+		} _reversal = {};
+		
+		struct
+		{
+			uint32_t heat;			// (0.1 A)² * ms above the rated current.
+			uint32_t last_time;
+			uint16_t duty_limit;	// Derated maximum duty, 0..1000.
+			bool blocked;
+			bool rejected;			// A start was refused, EVENT_THERMAL is pending.
+		} _thermal = { 0, 0, _duty_max, false, false };
 		
 		GPIO_InitTypeDef _pin_config = { GPIO_PIN_0, GPIO_MODE_OUTPUT_PP, GPIO_NOPULL, GPIO_SPEED_FREQ_LOW };
 		ADC_ChannelConfTypeDef _adc_config = { ADC_CHANNEL_0, ADC_REGULAR_RANK_1, ADC_SAMPLETIME_1CYCLE_5 };
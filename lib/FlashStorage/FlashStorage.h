@@ -0,0 +1,205 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+	Wear-levelled storage of one fixed-size record in two pages of the internal flash.
+
+	Every Save() appends a new copy of the record with an incremented sequence
+	number after the previous one, so a page is erased only once it is full and
+	the writing moves to the other page. The latest valid copy (magic + CRC) wins
+	on Load(); a copy torn by a reset during programming fails the CRC and the
+	previous one is used.
+
+	Each copy also carries a 'dirty' halfword that is left erased on Save().
+	Invalidate() programs it to 0x0000 in place, so marking the stored data as
+	stale (e.g. when a motor starts to move) costs one halfword write and no
+	new copy.
+
+	Programming and erasing stall the CPU: ~50 us per halfword, ~20 ms per page erase.
+*/
+template <typename T>
+class FlashStorage
+{
+	static constexpr uint16_t _magic = 0xC5A7;
+	static constexpr uint16_t _erased = 0xFFFF;
+
+	public:
+
+		FlashStorage(uint32_t page0, uint32_t page1, uint32_t page_size) : _page{ page0, page1 }, _page_size(page_size)
+		{
+			return;
+		}
+
+		// Reads the latest valid copy. clean = false if it was invalidated after saving.
+		bool Load(T &data, bool &clean)
+		{
+			_Scan();
+			if(_current == 0) return false;
+
+			const record_t *record = (const record_t *)_current;
+			memcpy(&data, &record->data, sizeof(T));
+			clean = (record->dirty == _erased);
+
+			return true;
+		}
+
+		bool Save(const T &data)
+		{
+			if(_scanned == false) _Scan();
+
+			record_t record;
+			memset(&record, 0xFF, sizeof(record));
+			record.magic = _magic;
+			record.sequence = _sequence + 1;
+			memcpy(&record.data, &data, sizeof(T));
+			record.crc = _CRC(record);
+
+			HAL_FLASH_Unlock();
+
+			uint32_t address = _next;
+			if(address == 0 || address + sizeof(record_t) > _page[_active] + _page_size)
+			{
+				// Current page is full (or nothing is stored yet): move to the other page.
+				_active = (_current == 0) ? 0 : _active ^ 1;
+				address = _page[_active];
+
+				if(_Erase(address) == false)
+				{
+					HAL_FLASH_Lock();
+					return false;
+				}
+			}
+
+			bool result = _Program(address, (const uint16_t *)&record, sizeof(record_t) / 2);
+
+			HAL_FLASH_Lock();
+
+			// A failed copy still occupies its slot.
+			_next = address + sizeof(record_t);
+			if(result == false || memcmp((const void *)address, &record, sizeof(record_t)) != 0) return false;
+
+			_current = address;
+			_sequence = record.sequence;
+
+			return true;
+		}
+
+		// Marks the latest copy as stale without writing a new one.
+		bool Invalidate()
+		{
+			if(_scanned == false) _Scan();
+			if(_current == 0) return false;
+
+			const record_t *record = (const record_t *)_current;
+			if(record->dirty != _erased) return true;
+
+			HAL_FLASH_Unlock();
+			HAL_StatusTypeDef status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, _current + offsetof(record_t, dirty), 0x0000);
+			HAL_FLASH_Lock();
+
+			return status == HAL_OK;
+		}
+
+	private:
+
+		typedef struct
+		{
+			uint16_t magic;
+			uint16_t sequence;
+			T data;
+			uint16_t crc;
+			uint16_t dirty;		// Not covered by the CRC, programmed to 0x0000 by Invalidate().
+		} record_t;
+
+		static_assert(sizeof(record_t) % 2 == 0, "Flash is programmed by halfwords");
+
+		// Finds the latest valid copy and the first free slot after it.
+		void _Scan()
+		{
+			_current = 0;
+			_next = 0;
+			_active = 0;
+
+			for(uint8_t page = 0; page < 2; ++page)
+			{
+				uint32_t address = _page[page];
+				for(; address + sizeof(record_t) <= _page[page] + _page_size; address += sizeof(record_t))
+				{
+					const record_t *record = (const record_t *)address;
+					if(record->magic == _erased) break;
+					if(record->magic != _magic || record->crc != _CRC(*record)) continue;
+
+					if(_current == 0 || (int16_t)(record->sequence - _sequence) > 0)
+					{
+						_current = address;
+						_sequence = record->sequence;
+						_active = page;
+					}
+				}
+
+				if(_current != 0 && _active == page)
+				{
+					_next = address;
+				}
+			}
+			_scanned = true;
+
+			return;
+		}
+
+		bool _Erase(uint32_t address)
+		{
+			FLASH_EraseInitTypeDef erase = {};
+			erase.TypeErase = FLASH_TYPEERASE_PAGES;
+			erase.PageAddress = address;
+			erase.NbPages = 1;
+
+			uint32_t error = 0;
+
+			return HAL_FLASHEx_Erase(&erase, &error) == HAL_OK;
+		}
+
+		bool _Program(uint32_t address, const uint16_t *data, uint16_t count)
+		{
+			for(uint16_t i = 0; i < count; ++i, address += 2)
+			{
+				// Erased halfwords are left untouched, so they can still be programmed later.
+				if(data[i] == _erased) continue;
+
+				if(HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address, data[i]) != HAL_OK) return false;
+			}
+
+			return true;
+		}
+
+		// CRC-16/CCITT of the record up to the crc field.
+		static uint16_t _CRC(const record_t &record)
+		{
+			const uint8_t *data = (const uint8_t *)&record;
+			uint16_t crc = 0xFFFF;
+
+			for(uint16_t i = 0; i < offsetof(record_t, crc); ++i)
+			{
+				crc ^= (uint16_t)data[i] << 8;
+				for(uint8_t bit = 0; bit < 8; ++bit)
+				{
+					crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+				}
+			}
+
+			return crc;
+		}
+
+		uint32_t _page[2];
+		uint32_t _page_size;
+
+		uint32_t _current = 0;		// Address of the latest valid copy, 0 - none.
+		uint32_t _next = 0;			// First free slot in the active page, 0 - unknown.
+		uint16_t _sequence = 0;
+		uint8_t _active = 0;
+		bool _scanned = false;
+
+};
@@ -25,16 +25,27 @@
 #include <LoggerLibrary.h>
 #include <About.h>
 #include <Leds.h>
+#include <PowerBudget.h>
 #include <OutputLogic.h>
 #include <TrunkHood.h>
+#include <EnergyStats.h>
+#include <ParkingMode.h>
+#include <CANStats.h>
+#include <CANHealth.h>
 #include <CANLogic.h>
+#ifdef CAN_BENCHMARK
+#include <CANBench.h>
+#endif
 
 // Peripheral variables
 ADC_HandleTypeDef hadc1;
+ADC_HandleTypeDef hadc2;
 CAN_HandleTypeDef hcan;
 SPI_HandleTypeDef hspi2;
 TIM_HandleTypeDef htim1;
 TIM_HandleTypeDef htim2;
+TIM_HandleTypeDef htim3;
+TIM_HandleTypeDef htim4;
 DMA_HandleTypeDef hdma_tim2_ch1;
 UART_HandleTypeDef hDebugUart;
 
@@ -45,6 +56,11 @@ static void MX_GPIO_Init(void);
 static void MX_CAN_Init(void);
 static void MX_USART1_UART_Init(void);
 static void MX_ADC1_Init(void);
+static void MX_ADC2_Init(void);
+static void MX_TIM1_Init(void);
+static void MX_TIM2_Init(void);
+static void MX_TIM3_Init(void);
+static void MX_TIM4_Init(void);
 
 
 
@@ -55,27 +71,96 @@ void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan)
 	
 	if( HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO0, &RxHeader, RxData) == HAL_OK )
 	{
+		CANStats::OnRxFrame(RxHeader.StdId, RxHeader.DLC);
+		EnergyStats::OnRxFrame();
+		if(RxHeader.DLC > 0) Parking::OnRxFrame(RxHeader.StdId, RxData[0]);
 		CANLib::can_manager.IncomingCANFrame(RxHeader.StdId, RxData, RxHeader.DLC);
 	}
 	
 	return;
 }
 
+void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+	CANStats::OnTxComplete(CAN_TX_MAILBOX0, hcan->Instance->sTxMailBox[0].TDTR & CAN_TDT0R_DLC);
+	
+	return;
+}
+
+void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+	CANStats::OnTxComplete(CAN_TX_MAILBOX1, hcan->Instance->sTxMailBox[1].TDTR & CAN_TDT0R_DLC);
+	
+	return;
+}
+
+void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef *hcan)
+{
+	CANStats::OnTxComplete(CAN_TX_MAILBOX2, hcan->Instance->sTxMailBox[2].TDTR & CAN_TDT0R_DLC);
+	
+	return;
+}
+
 void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *hcan)
 {
 	Leds::obj.SetOn(Leds::LED_YELLOW, 100);
 	
-	DEBUG_LOG_TOPIC("CAN", "RX error event, code: 0x%08lX\n", HAL_CAN_GetError(hcan));
+	// ErrorIRQ() сбрасывает код ошибки HAL, поэтому он читается до вызова.
+	uint32_t error = HAL_CAN_GetError(hcan);
+	CANHealth::ErrorIRQ(hcan);
+	
+	DEBUG_LOG_TOPIC("CAN", "RX error event, code: 0x%08lX\n", error);
+	
+	return;
+}
+
+void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
+{
+	uint32_t stamp = DWT->CYCCNT;
+	
+	TrunkHood::FaultIRQ(GPIO_Pin, stamp);
+	
+	return;
+}
+
+void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
+{
+	if(htim->Instance == TIM1)
+	{
+		Outputs::FadeIRQ();
+	}
+	else if(htim->Instance == TIM4)
+	{
+		Outputs::PatternIRQ();
+	}
+	
+	return;
+}
+
+void HAL_ADC_LevelOutOfWindowCallback(ADC_HandleTypeDef *hadc)
+{
+	uint32_t stamp = DWT->CYCCNT;
+	
+	if(hadc->Instance == ADC2)
+	{
+		Outputs::ShortCircuitIRQ(stamp);
+	}
 	
 	return;
 }
 
 void HAL_CAN_Send(can_object_id_t id, uint8_t *data, uint8_t length)
 {
+#ifdef CAN_BENCHMARK
+	CANBench::OnSend(id);
+#else
 	CAN_TxHeaderTypeDef TxHeader = {0};
 	uint8_t TxData[8] = {0};
     uint32_t TxMailbox = 0;
 	
+	// Узел отключён от шины политикой восстановления после bus-off.
+	if( CANHealth::IsSuspended() == true ) return;
+	
 	TxHeader.StdId = id;
 	TxHeader.ExtId = 0;
 	TxHeader.RTR  = CAN_RTR_DATA;
@@ -96,6 +181,11 @@ void HAL_CAN_Send(can_object_id_t id, uint8_t *data, uint8_t length)
 
 		DEBUG_LOG_TOPIC("CAN", "TX error event, code: 0x%08lX\n", HAL_CAN_GetError(&hcan));
 	}
+	else
+	{
+		CANStats::OnTxFrame(id, TxMailbox);
+	}
+#endif
 	
 	return;
 }
@@ -109,7 +199,11 @@ void InitPeripherals()
     MX_CAN_Init();
     MX_USART1_UART_Init();
     MX_ADC1_Init();
-    HAL_TIM_Base_Start_IT(&htim1);
+    MX_ADC2_Init();
+    MX_TIM1_Init();
+    MX_TIM2_Init();
+    MX_TIM3_Init();
+    MX_TIM4_Init();
 };
 
 /// @brief  The application entry point.
@@ -132,18 +226,26 @@ int main(void)
     // When at least one mailbox is free, LED will go off.
 	About::Setup();
 	Leds::Setup();
+	CANStats::Setup();
 	
 	/* активируем события которые будут вызывать прерывания  */
-    HAL_CAN_ActivateNotification(&hcan, CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_ERROR | CAN_IT_BUSOFF | CAN_IT_LAST_ERROR_CODE);
+    HAL_CAN_ActivateNotification(&hcan, CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_TX_MAILBOX_EMPTY | CAN_IT_ERROR | CAN_IT_BUSOFF | CAN_IT_ERROR_PASSIVE | CAN_IT_ERROR_WARNING | CAN_IT_LAST_ERROR_CODE);
 
     HAL_CAN_Start(&hcan);
 
     CANLib::Setup();
+    CANHealth::Setup();
     Outputs::Setup();
 	TrunkHood::Setup();
+	EnergyStats::Setup();
+	Parking::Setup();
 
 	Leds::obj.SetOn(Leds::LED_GREEN, 50, 1950);
 
+#ifdef CAN_BENCHMARK
+	CANBench::Setup();
+#endif
+
     uint32_t current_time = HAL_GetTick();
     while (1)
     {
@@ -151,9 +253,17 @@ int main(void)
         // current_time = HAL_GetTick();
         About::Loop(current_time);
 		Leds::Loop(current_time);
+#ifdef CAN_BENCHMARK
+		CANBench::Loop(current_time);
+#endif
         CANLib::Loop(current_time);
+        CANHealth::Loop(current_time);
+        CANStats::Loop(current_time);
+        PowerBudget::Loop(current_time);
         Outputs::Loop(current_time);
 		TrunkHood::Loop(current_time);
+		EnergyStats::Loop(current_time);
+		Parking::Loop(current_time);
     }
 }
 
@@ -222,6 +332,186 @@ static void MX_ADC1_Init(void)
     }
 }
 
+/**
+ * @brief ADC2 Initialization Function: continuous scan of the PowerOut port currents for the analog watchdog.
+ * Channels and the watchdog are configured in Outputs::Setup().
+ * @param None
+ * @retval None
+ */
+static void MX_ADC2_Init(void)
+{
+    /* Common config */
+    hadc2.Instance = ADC2;
+    hadc2.Init.ScanConvMode = ADC_SCAN_ENABLE;
+    hadc2.Init.ContinuousConvMode = ENABLE;
+    hadc2.Init.DiscontinuousConvMode = DISABLE;
+    hadc2.Init.ExternalTrigConv = ADC_SOFTWARE_START;
+    hadc2.Init.DataAlign = ADC_DATAALIGN_RIGHT;
+    hadc2.Init.NbrOfConversion = Outputs::CFG_PortCount;
+    if (HAL_ADC_Init(&hadc2) != HAL_OK)
+    {
+        Error_Handler();
+    }
+}
+
+/**
+ * @brief TIM1 Initialization Function: 1 kHz PWM on CH1N (PB13), cabin light dimmer.
+ * The update interrupt drives the fade engine, see Outputs::FadeIRQ().
+ * @param None
+ * @retval None
+ */
+static void MX_TIM1_Init(void)
+{
+    TIM_ClockConfigTypeDef sClockSourceConfig = {0};
+    TIM_OC_InitTypeDef sConfigOC = {0};
+
+    htim1.Instance = TIM1;
+    htim1.Init.Prescaler = 63;
+    htim1.Init.CounterMode = TIM_COUNTERMODE_UP;
+    htim1.Init.Period = 999;
+    htim1.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+    htim1.Init.RepetitionCounter = 0;
+    htim1.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
+    if (HAL_TIM_Base_Init(&htim1) != HAL_OK)
+    {
+        Error_Handler();
+    }
+    sClockSourceConfig.ClockSource = TIM_CLOCKSOURCE_INTERNAL;
+    if (HAL_TIM_ConfigClockSource(&htim1, &sClockSourceConfig) != HAL_OK)
+    {
+        Error_Handler();
+    }
+    if (HAL_TIM_PWM_Init(&htim1) != HAL_OK)
+    {
+        Error_Handler();
+    }
+    // Only CH1N is enabled: OC1N follows OC1REF, so PWM1 gives a high-active duty.
+    sConfigOC.OCMode = TIM_OCMODE_PWM1;
+    sConfigOC.Pulse = 0;
+    sConfigOC.OCPolarity = TIM_OCPOLARITY_HIGH;
+    sConfigOC.OCNPolarity = TIM_OCNPOLARITY_HIGH;
+    sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
+    sConfigOC.OCIdleState = TIM_OCIDLESTATE_RESET;
+    sConfigOC.OCNIdleState = TIM_OCNIDLESTATE_RESET;
+    if (HAL_TIM_PWM_ConfigChannel(&htim1, &sConfigOC, TIM_CHANNEL_1) != HAL_OK)
+    {
+        Error_Handler();
+    }
+}
+
+/**
+ * @brief TIM2 Initialization Function: 20 kHz PWM on CH3 (PB10) and CH4 (PB11), trunk actuator IN1/IN2
+ * @param None
+ * @retval None
+ */
+static void MX_TIM2_Init(void)
+{
+    TIM_ClockConfigTypeDef sClockSourceConfig = {0};
+    TIM_OC_InitTypeDef sConfigOC = {0};
+
+    htim2.Instance = TIM2;
+    htim2.Init.Prescaler = 0;
+    htim2.Init.CounterMode = TIM_COUNTERMODE_UP;
+    htim2.Init.Period = 3199;
+    htim2.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+    htim2.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
+    if (HAL_TIM_Base_Init(&htim2) != HAL_OK)
+    {
+        Error_Handler();
+    }
+    sClockSourceConfig.ClockSource = TIM_CLOCKSOURCE_INTERNAL;
+    if (HAL_TIM_ConfigClockSource(&htim2, &sClockSourceConfig) != HAL_OK)
+    {
+        Error_Handler();
+    }
+    if (HAL_TIM_PWM_Init(&htim2) != HAL_OK)
+    {
+        Error_Handler();
+    }
+    sConfigOC.OCMode = TIM_OCMODE_PWM1;
+    sConfigOC.Pulse = 0;
+    sConfigOC.OCPolarity = TIM_OCPOLARITY_HIGH;
+    sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
+    if (HAL_TIM_PWM_ConfigChannel(&htim2, &sConfigOC, TIM_CHANNEL_3) != HAL_OK)
+    {
+        Error_Handler();
+    }
+    if (HAL_TIM_PWM_ConfigChannel(&htim2, &sConfigOC, TIM_CHANNEL_4) != HAL_OK)
+    {
+        Error_Handler();
+    }
+}
+
+/**
+ * @brief TIM3 Initialization Function: 20 kHz PWM on CH3 (PB0) and CH4 (PB1), hood actuator IN2/IN1
+ * @param None
+ * @retval None
+ */
+static void MX_TIM3_Init(void)
+{
+    TIM_ClockConfigTypeDef sClockSourceConfig = {0};
+    TIM_OC_InitTypeDef sConfigOC = {0};
+
+    htim3.Instance = TIM3;
+    htim3.Init.Prescaler = 0;
+    htim3.Init.CounterMode = TIM_COUNTERMODE_UP;
+    htim3.Init.Period = 3199;
+    htim3.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+    htim3.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
+    if (HAL_TIM_Base_Init(&htim3) != HAL_OK)
+    {
+        Error_Handler();
+    }
+    sClockSourceConfig.ClockSource = TIM_CLOCKSOURCE_INTERNAL;
+    if (HAL_TIM_ConfigClockSource(&htim3, &sClockSourceConfig) != HAL_OK)
+    {
+        Error_Handler();
+    }
+    if (HAL_TIM_PWM_Init(&htim3) != HAL_OK)
+    {
+        Error_Handler();
+    }
+    sConfigOC.OCMode = TIM_OCMODE_PWM1;
+    sConfigOC.Pulse = 0;
+    sConfigOC.OCPolarity = TIM_OCPOLARITY_HIGH;
+    sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
+    if (HAL_TIM_PWM_ConfigChannel(&htim3, &sConfigOC, TIM_CHANNEL_3) != HAL_OK)
+    {
+        Error_Handler();
+    }
+    if (HAL_TIM_PWM_ConfigChannel(&htim3, &sConfigOC, TIM_CHANNEL_4) != HAL_OK)
+    {
+        Error_Handler();
+    }
+}
+
+/**
+ * @brief TIM4 Initialization Function: 1 kHz update interrupt, output pattern tick.
+ * See Outputs::PatternIRQ().
+ * @param None
+ * @retval None
+ */
+static void MX_TIM4_Init(void)
+{
+    TIM_ClockConfigTypeDef sClockSourceConfig = {0};
+
+    htim4.Instance = TIM4;
+    htim4.Init.Prescaler = 63;
+    htim4.Init.CounterMode = TIM_COUNTERMODE_UP;
+    htim4.Init.Period = 999;
+    htim4.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+    htim4.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
+    if (HAL_TIM_Base_Init(&htim4) != HAL_OK)
+    {
+        Error_Handler();
+    }
+    sClockSourceConfig.ClockSource = TIM_CLOCKSOURCE_INTERNAL;
+    if (HAL_TIM_ConfigClockSource(&htim4, &sClockSourceConfig) != HAL_OK)
+    {
+        Error_Handler();
+    }
+}
+
 /**
  * @brief CAN Initialization Function
  * @param None
@@ -325,6 +615,10 @@ static void MX_GPIO_Init(void)
     //GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
     //HAL_GPIO_Init(GPIOC, &GPIO_InitStruct);
 
+    /* EXTI interrupt init: nFAULT of the actuator drivers, PC14 and PC15 (pins are configured by DRV8874::Init) */
+    HAL_NVIC_SetPriority(EXTI15_10_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(EXTI15_10_IRQn);
+
 	HAL_GPIO_WritePin(GPIOA, GPIO_PIN_15, GPIO_PIN_RESET);
 
     /*Configure GPIO pins : PA7 PA15 */